@@ -20,6 +20,20 @@
 
 static dev_t scull_a_firstdev;  // 此类设备起始设备号
 
+// 只写打开时清空设备, 与scull_open一样在dev->sem下trim, 设备被映射时失败
+static int scull_a_trim(struct file *filp, struct scull_dev *dev)
+{
+    int retval;
+
+    if ((filp->f_flags & O_ACCMODE) != O_WRONLY)
+        return 0;
+    if (down_interruptible(&dev->sem))
+        return -ERESTARTSYS;
+    retval = scull_trim(dev);
+    up(&dev->sem);
+    return retval;
+}
+
 /*********************single 设备***********************/
 static struct scull_dev scull_s_device;
 static atomic_t scull_s_available = ATOMIC_INIT(1);
@@ -28,6 +42,7 @@ static atomic_t scull_s_available = ATOMIC_INIT(1);
 static int scull_s_open(struct inode *inode, struct file *filp)
 {
     struct scull_dev *dev = &scull_s_device;
+    int retval;
 
     if (!atomic_dec_and_test(&scull_s_available)) {
         atomic_inc(&scull_s_available);
@@ -35,8 +50,11 @@ static int scull_s_open(struct inode *inode, struct file *filp)
     }
 
     // 判断打开权限
-    if ((filp->f_flags & O_ACCMODE) == O_WRONLY)
-        scull_trim(dev);
+    retval = scull_a_trim(filp, dev);
+    if (retval) {
+        atomic_inc(&scull_s_available);
+        return retval;
+    }
     filp->private_data = dev;
     return 0;   // success
 }
@@ -53,6 +71,8 @@ struct file_operations scull_sngl_fops = {
 	.llseek =     	scull_llseek,
 	.read =       	scull_read,
 	.write =      	scull_write,
+	.readv =      	scull_readv,
+	.writev =     	scull_writev,
 	.ioctl =      	scull_ioctl,
 	.open =       	scull_s_open,
 	.release =    	scull_s_release,
@@ -68,6 +88,8 @@ static spinlock_t scull_u_lock = SPIN_LOCK_UNLOCKED;
 static int scull_u_open(struct inode *inode, struct file *filp)
 {
     struct scull_dev *dev = &scull_s_device;
+    int retval;
+
     spin_lock(&scull_u_lock);
     if (scull_u_count &&
             (scull_u_owner != current->uid) &&  // 允许的用户
@@ -83,8 +105,13 @@ static int scull_u_open(struct inode *inode, struct file *filp)
     scull_u_count++;
     spin_unlock(&scull_u_lock);
 
-    if ((filp->f_flags & O_ACCMODE) == O_WRONLY)
-		scull_trim(dev);
+    retval = scull_a_trim(filp, dev);
+    if (retval) {
+        spin_lock(&scull_u_lock);
+        scull_u_count--;
+        spin_unlock(&scull_u_lock);
+        return retval;
+    }
 	filp->private_data = dev;
 	return 0;          // 成功
 }
@@ -104,6 +131,8 @@ struct file_operations scull_user_fops = {
 	.llseek =     scull_llseek,
 	.read =       scull_read,
 	.write =      scull_write,
+	.readv =      scull_readv,
+	.writev =     scull_writev,
 	.ioctl =      scull_ioctl,
 	.open =       scull_u_open,
 	.release =    scull_u_release,
@@ -128,6 +157,7 @@ static inline int scull_w_available(void)
 static int scull_w_open(struct inode *inode, struct file *filp)
 {
     struct scull_dev *dev = &scull_w_device;
+    int retval, temp;
 
     spin_lock(&scull_w_lock);
     while(!scull_w_available()) {
@@ -143,8 +173,15 @@ static int scull_w_open(struct inode *inode, struct file *filp)
     scull_w_count++;
     spin_unlock(&scull_w_lock);
     
-    if ((filp->f_flags & O_ACCMODE) == O_WRONLY)
-		scull_trim(dev);
+    retval = scull_a_trim(filp, dev);
+    if (retval) {
+        spin_lock(&scull_w_lock);   // 放弃授权, 唤醒等待者
+        temp = --scull_w_count;
+        spin_unlock(&scull_w_lock);
+        if (temp == 0)
+            wake_up_interruptible_sync(&scull_w_wait);
+        return retval;
+    }
 	filp->private_data = dev;
 	return 0;          // 成功
 }
@@ -168,6 +205,8 @@ struct file_operations scull_wusr_fops = {
 	.llseek =     scull_llseek,
 	.read =       scull_read,
 	.write =      scull_write,
+	.readv =      scull_readv,
+	.writev =     scull_writev,
 	.ioctl =      scull_ioctl,
 	.open =       scull_w_open,
 	.release =    scull_w_release,    
@@ -204,8 +243,7 @@ static struct scull_dev *scull_c_lookfor_device(dev_t key)
     // 初始化设备
     memset(lptr, 0, sizeof(struct scull_listitem));
     lptr->key = key;
-    scull_trim(&(lptr->device));
-    init_MUTEX(&(lptr->device.sem));
+    scull_dev_init(&(lptr->device));
 
     // 添加到列表中
     list_add(&lptr->list, &scull_c_list);
@@ -217,6 +255,7 @@ static int scull_c_open(struct inode *inode, struct file *filp)
 {
     struct scull_dev *dev;
     dev_t key;
+    int retval;
 
     if (!current->signal->tty) {
         PDEBUG("Process \"%s\" has no ctl tty\n", current->comm);
@@ -231,8 +270,9 @@ static int scull_c_open(struct inode *inode, struct file *filp)
 
     if (!dev)
         return -ENOMEM;
-    if ( (filp->f_flags & O_ACCMODE) == O_WRONLY)
-		scull_trim(dev);
+    retval = scull_a_trim(filp, dev);
+    if (retval)
+        return retval;
 	filp->private_data = dev;
 	return 0;          // 成功
 
@@ -251,6 +291,8 @@ struct file_operations scull_priv_fops = {
 	.llseek =   scull_llseek,
 	.read =     scull_read,
 	.write =    scull_write,
+	.readv =    scull_readv,
+	.writev =   scull_writev,
 	.ioctl =    scull_ioctl,
 	.open =     scull_c_open,
 	.release =  scull_c_release,
@@ -277,9 +319,7 @@ static void scull_access_setup(dev_t devno, struct scull_adev_info *devinfo)
     int err;
 
     // 初始化设备结构
-    dev->quantum = scull_quantum;
-    dev->qset = scull_qset;
-    init_MUTEX(&dev->sem);
+    scull_dev_init(dev);
 
     // cdev 填充
     cdev_init(&dev->cdev, devinfo->fops);
@@ -322,13 +362,13 @@ void scull_access_cleanup(void)
     for (i = 0; i< SCULL_N_ADEVS; i++) {
         struct scull_dev *dev = scull_access_devs[i].sculldev;
         cdev_del(&dev->cdev);
-        scull_trim(scull_access_devs[i].sculldev);
+        scull_dev_cleanup(scull_access_devs[i].sculldev);
     }
 
     // 清理所有复制的设备
     list_for_each_entry_safe(lptr, next, &scull_c_list, list) {
         list_del(&lptr->list);
-        scull_trim(&(lptr->device));
+        scull_dev_cleanup(&(lptr->device));
         kfree(lptr);
     }
 
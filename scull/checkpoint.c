@@ -0,0 +1,397 @@
+/*
+ * checkpoint.c -- scull设备内容的检查点和恢复
+ * 设备i的内容保存在备份文件 "<scull_backing>i" 中:
+ *   偏移0:                   struct scull_ckpt_header
+ *   偏移SCULL_CKPT_DATA + pos: 设备中偏移pos处的数据
+ * 完整检查点截断文件后只写入存在的量子, 空洞和全0量子成为文件中的空洞;
+ * 增量检查点只重写量子集脏位图中标记的量子(被打洞的量子写入0)
+ * 文件读写在内核线程中进行, 相邻的量子先复制到缓冲区, 合并成大的顺序写
+ * 写者不会被停止, 每个量子是一致的, 但并发写入时得到的不是某一时刻的
+ * 映像; 需要时先用SCULL_IOCSNAP建立快照, 再对快照做检查点
+ */
+
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/file.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/sched.h>
+#include <linux/kthread.h>
+#include <linux/completion.h>
+#include <linux/err.h>
+#include <linux/uio.h>
+#include <asm/uaccess.h>
+#include <asm/bitops.h>
+
+#include "scull.h"
+
+char *scull_backing;        // 备份文件名前缀, 为NULL时不支持检查点
+int scull_restore;          // 加载时从备份文件恢复
+int scull_ckpt_unload;      // 卸载时做一次增量检查点
+
+module_param(scull_backing, charp, S_IRUGO);
+module_param(scull_restore, int, S_IRUGO);
+module_param(scull_ckpt_unload, int, S_IRUGO);
+
+#define SCULL_CKPT_MAGIC	0x5343554c  // "SCUL"
+#define SCULL_CKPT_VERSION	1
+#define SCULL_CKPT_DATA		4096        // 数据在文件中的起始偏移
+#define SCULL_CKPT_BUF		(1 << 20)   // 合并读写的缓冲区大小
+
+struct scull_ckpt_header {
+    u32 magic;
+    u32 version;
+    u32 quantum;
+    u32 qset;
+    u64 size;
+};
+
+// 交给内核线程的请求, 由等待者分配
+struct scull_ckpt_req {
+    struct scull_dev *dev;
+    int index;
+    int mode;               // SCULL_CKPT_*
+    int restore;            // 非0表示恢复
+    int result;
+    struct completion done;
+};
+
+// 正在合并的一段连续数据
+struct scull_ckpt_run {
+    struct scull_dev *dev;
+    struct file *filp;
+    char *buf;
+    size_t size;            // 缓冲区大小
+    size_t len;             // 已缓存的字节数
+    loff_t pos;             // 缓存数据在设备中的偏移
+};
+
+// 同一时刻只有一个检查点或恢复在进行
+static DECLARE_MUTEX(scull_ckpt_sem);
+
+// 设备在scull_devices中的序号, 其他设备(如sculluid)返回-1
+static int scull_ckpt_index(struct scull_dev *dev)
+{
+    int index = dev - scull_devices;
+
+    return index >= 0 && index < scull_nr_devs ? index : -1;
+}
+
+static struct file *scull_ckpt_open(int index, int flags)
+{
+    struct file *filp;
+    size_t len = strlen(scull_backing) + 12;
+    char *name;
+
+    name = kmalloc(len, GFP_KERNEL);
+    if (!name)
+        return ERR_PTR(-ENOMEM);
+    snprintf(name, len, "%s%i", scull_backing, index);
+    filp = filp_open(name, flags | O_LARGEFILE, 0600);
+    kfree(name);
+    return filp;
+}
+
+// 写出缓冲区中的数据
+static int scull_ckpt_flush(struct scull_ckpt_run *run)
+{
+    ssize_t ret;
+
+    if (!run->len)
+        return 0;
+    ret = scull_file_io(run->filp, run->buf, run->len,
+                        SCULL_CKPT_DATA + run->pos, 1);
+    run->len = 0;
+    return ret < 0 ? ret : 0;
+}
+
+/**
+ * 把设备中偏移pos处的量子加入缓冲区, q为NULL时写入0, 为换出标记时
+ * 直接从交换文件读入缓冲区, 压缩的量子直接解压到缓冲区, 都不调入内存
+ * 与缓存的数据不相邻或缓冲区已满时先写出, 调用者持有量子集的锁,
+ * 因此同一量子集的写者最多等待一个缓冲区的写入
+ */
+static int scull_ckpt_add(struct scull_ckpt_run *run, loff_t pos,
+                            const void *q, int quantum)
+{
+    ssize_t ret;
+    int retval = 0;
+
+    if (run->len && (run->pos + run->len != pos ||
+                    run->len + quantum > run->size))
+        retval = scull_ckpt_flush(run);
+    if (retval)
+        return retval;
+    if (!run->len)
+        run->pos = pos;
+    if (q == SCULL_SWAPPED_QUANTUM) {
+        ret = scull_tier_read(run->dev, run->buf + run->len, pos, quantum);
+        if (ret < 0)
+            return ret;
+    } else if (scull_quantum_zipped(q)) {
+        ret = scull_unzip(run->dev, q, run->buf + run->len, quantum);
+        if (ret < 0)
+            return ret;
+    } else if (q) {
+        memcpy(run->buf + run->len, q, quantum);
+    } else {
+        memset(run->buf + run->len, 0, quantum);
+    }
+    run->len += quantum;
+    return 0;
+}
+
+static int scull_do_checkpoint(struct scull_dev *dev, int index, int mode)
+{
+    struct scull_ckpt_header hdr;
+    struct scull_ckpt_run run;
+    struct scull_qset *dptr;
+    struct scull_geom g;
+    unsigned long size, gen;
+    int quantum, qset, full, dirty, s_pos, retval = 0;
+    loff_t pos;
+    ssize_t ret;
+    void *q;
+
+    spin_lock(&dev->lock);
+    size = dev->size;
+    gen = dev->gen;
+    quantum = dev->quantum;
+    qset = dev->qset;
+    full = mode == SCULL_CKPT_FULL || dev->ckpt_stale;
+    // 下面会清除脏位, 完成之前文件与脏位图不对应
+    dev->ckpt_stale = 1;
+    spin_unlock(&dev->lock);
+
+    run.filp = scull_ckpt_open(index, O_WRONLY | O_CREAT | (full ? O_TRUNC : 0));
+    if (IS_ERR(run.filp))
+        return PTR_ERR(run.filp);
+    run.dev = dev;
+    run.size = max(SCULL_CKPT_BUF, quantum);
+    run.len = 0;
+    run.buf = vmalloc(run.size);
+    if (!run.buf) {
+        retval = -ENOMEM;
+        goto out;
+    }
+
+    for (pos = 0; pos < size && !retval; ) {
+        dptr = scull_get_qset(dev, pos, 0, &g);
+        if (IS_ERR(dptr)) {
+            retval = PTR_ERR(dptr);
+            break;
+        }
+        // 期间设备被清空或重整, 已写入的数据不再有意义
+        if (g.gen != gen || g.quantum != quantum || g.qset != qset) {
+            if (dptr)
+                up(&dptr->sem);
+            retval = -EAGAIN;
+            break;
+        }
+        if (!dptr) {
+            // 量子集只在trim或重整时消失, 文件中对应的范围已经是0
+            pos += g.itemsize - g.rest;
+            continue;
+        }
+        while (pos < size && g.rest < g.itemsize) {
+            s_pos = g.rest / quantum;
+            q = dptr->data[s_pos];
+            if (q == SCULL_ZERO_QUANTUM)
+                q = NULL;
+            dirty = test_and_clear_bit(s_pos, scull_qset_dirty(dptr, qset));
+            if (full ? q != NULL : dirty)
+                retval = scull_ckpt_add(&run, pos, q, quantum);
+            if (retval)
+                break;
+            pos += quantum;
+            g.rest += quantum;
+        }
+        up(&dptr->sem);
+    }
+    if (!retval)
+        retval = scull_ckpt_flush(&run);
+    vfree(run.buf);
+
+    if (!retval) {
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.magic = SCULL_CKPT_MAGIC;
+        hdr.version = SCULL_CKPT_VERSION;
+        hdr.quantum = quantum;
+        hdr.qset = qset;
+        hdr.size = size;
+        ret = scull_file_io(run.filp, &hdr, sizeof(hdr), 0, 1);
+        if (ret < 0)
+            retval = ret;
+    }
+    if (!retval && run.filp->f_op && run.filp->f_op->fsync)
+        retval = run.filp->f_op->fsync(run.filp, run.filp->f_dentry, 0);
+    if (!retval) {
+        spin_lock(&dev->lock);
+        if (dev->gen == gen && dev->quantum == quantum && dev->qset == qset)
+            dev->ckpt_stale = 0;
+        spin_unlock(&dev->lock);
+    }
+out:
+    filp_close(run.filp, NULL);
+    return retval;
+}
+
+// 清除设备中所有的脏位, 恢复完成后文件与内存一致
+static void scull_ckpt_clean(struct scull_dev *dev)
+{
+    struct scull_index *idx;
+    int i;
+
+    down(&dev->sem);
+    idx = dev->data;
+    for (i = 0; idx && i < idx->nitems; i++) {
+        if (!idx->items[i])
+            continue;
+        down(&idx->items[i]->sem);
+        memset(scull_qset_dirty(idx->items[i], idx->qset), 0,
+                BITS_TO_LONGS(idx->qset) * sizeof(long));
+        up(&idx->items[i]->sem);
+    }
+    spin_lock(&dev->lock);
+    dev->ckpt_stale = 0;
+    spin_unlock(&dev->lock);
+    up(&dev->sem);
+}
+
+/**
+ * 从备份文件恢复一个空设备, 按文件中的几何参数设置设备
+ * 数据按缓冲区大小顺序读出, 经由scull_dev_writev写入, 全0的量子因此
+ * 不占用内存. 失败时清空设备
+ */
+static int scull_do_restore(struct scull_dev *dev, int index)
+{
+    struct scull_ckpt_header hdr;
+    struct scull_geometry geo;
+    struct file *filp;
+    struct iovec iov;
+    mm_segment_t old_fs;
+    loff_t pos = 0, off;
+    size_t chunk;
+    ssize_t ret;
+    char *buf = NULL;
+    int retval = 0, own_geom, auto_geom;
+
+    filp = scull_ckpt_open(index, O_RDONLY);
+    if (IS_ERR(filp))
+        return PTR_ERR(filp);
+    ret = scull_file_io(filp, &hdr, sizeof(hdr), 0, 0);
+    if (ret != sizeof(hdr) || hdr.magic != SCULL_CKPT_MAGIC ||
+            hdr.version != SCULL_CKPT_VERSION || hdr.size > LONG_MAX) {
+        retval = ret < 0 ? ret : -EINVAL;
+        goto out;
+    }
+    geo.quantum = hdr.quantum;
+    geo.qset = hdr.qset;
+    geo.flags = 0;
+    own_geom = dev->own_geom;
+    auto_geom = dev->auto_geom;
+    if (hdr.quantum > INT_MAX || hdr.qset > INT_MAX)
+        retval = -EINVAL;
+    else
+        retval = scull_set_geometry(dev, &geo);
+    if (retval)
+        goto out;
+    flush_workqueue(scull_wq);  // 空设备的重整只是修改参数
+    // 文件中的参数只用于这份数据, 设备是否跟随全局参数保持不变
+    spin_lock(&dev->lock);
+    dev->own_geom = own_geom;
+    dev->auto_geom = auto_geom;
+    spin_unlock(&dev->lock);
+
+    buf = vmalloc(SCULL_CKPT_BUF);
+    if (!buf) {
+        retval = -ENOMEM;
+        goto out;
+    }
+    while (pos < hdr.size) {
+        chunk = min((u64)SCULL_CKPT_BUF, hdr.size - pos);
+        ret = scull_file_io(filp, buf, chunk, SCULL_CKPT_DATA + pos, 0);
+        if (ret < 0) {
+            retval = ret;
+            break;
+        }
+        // 末尾的空洞没有写入文件
+        memset(buf + ret, 0, chunk - ret);
+
+        iov.iov_base = (void __user *)buf;
+        iov.iov_len = chunk;
+        off = pos;
+        old_fs = get_fs();
+        set_fs(KERNEL_DS);
+        ret = scull_dev_writev(dev, &iov, 1, &off);
+        set_fs(old_fs);
+        if (ret != chunk) {
+            retval = ret < 0 ? ret : -EIO;
+            break;
+        }
+        pos += chunk;
+        cond_resched();
+    }
+    vfree(buf);
+
+    if (retval) {
+        down(&dev->sem);
+        scull_trim(dev);
+        up(&dev->sem);
+    } else {
+        scull_ckpt_clean(dev);
+    }
+out:
+    filp_close(filp, NULL);
+    return retval;
+}
+
+static int scull_ckpt_thread(void *data)
+{
+    struct scull_ckpt_req *req = data;
+
+    down(&scull_ckpt_sem);
+    if (req->restore)
+        req->result = scull_do_restore(req->dev, req->index);
+    else
+        req->result = scull_do_checkpoint(req->dev, req->index, req->mode);
+    up(&scull_ckpt_sem);
+    complete_and_exit(&req->done, 0);
+}
+
+// 在内核线程中执行检查点或恢复并等待完成, 文件在内核线程的上下文中打开
+static int scull_ckpt_start(struct scull_dev *dev, int mode, int restore)
+{
+    struct scull_ckpt_req req;
+    struct task_struct *task;
+
+    if (!scull_backing)
+        return -EOPNOTSUPP;
+    req.index = scull_ckpt_index(dev);
+    if (req.index < 0)
+        return -ENOTTY;
+    req.dev = dev;
+    req.mode = mode;
+    req.restore = restore;
+    req.result = 0;
+    init_completion(&req.done);
+
+    task = kthread_run(scull_ckpt_thread, &req, "scull_ckpt%d", req.index);
+    if (IS_ERR(task))
+        return PTR_ERR(task);
+    wait_for_completion(&req.done);
+    return req.result;
+}
+
+int scull_checkpoint(struct scull_dev *dev, int mode)
+{
+    return scull_ckpt_start(dev, mode, 0);
+}
+
+// 加载模块时调用, 设备尚未注册
+int scull_ckpt_restore(struct scull_dev *dev)
+{
+    return scull_ckpt_start(dev, 0, 1);
+}
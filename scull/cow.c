@@ -0,0 +1,213 @@
+/*
+ * cow.c -- 量子的共享和写时复制
+ * 快照(scull_snapshot)让两个设备引用同一批量子. 被共享的量子记录在
+ * 以地址为键的全局散列表中, 表项的count为引用数, 只剩一个引用时表项
+ * 被删除, 量子重新成为独占的. 没有共享量子时scull_nr_shared为0,
+ * 释放者不查表, 也不获取scull_share_lock; 写者只查量子集中共享位
+ * 置位的量子, 设备中有共享量子时写入其他量子也不获取全局的锁
+ * 写者修改共享的量子前先复制一份私有的(scull_cow), 被替换下的量子
+ * 在宽限期后才放弃引用, 之前开始的读者读到的仍是快照时的内容
+ */
+
+#include "shim.h"
+#ifdef __KERNEL__
+#include <linux/hash.h>
+#endif
+
+#include "scull.h"
+
+/**
+ * 共享整个设备(快照, reflink)时每个量子都有一个表项, 桶数要与量子数
+ * 同一数量级, 否则增加引用和写时复制都要扫描很长的链
+ */
+#ifndef SCULL_SHARE_BITS
+#define SCULL_SHARE_BITS	16
+#endif
+#define SCULL_SHARE_BUCKETS	(1 << SCULL_SHARE_BITS)
+
+struct scull_share {
+    struct scull_share *next;
+    void *q;
+    int count;                  // 引用数, 总是 >= 2
+};
+
+static struct scull_share *scull_share_hash[SCULL_SHARE_BUCKETS];
+static spinlock_t scull_share_lock = SPIN_LOCK_UNLOCKED;
+static atomic_t scull_nr_shared = ATOMIC_INIT(0);   // 表项数
+
+// 被替换下的共享量子, 宽限期过后在scull_wq中放弃引用
+struct scull_cow_drop {
+    struct rcu_head rcu;
+    struct work_struct work;
+    struct scull_dev *dev;
+    void *q;
+    int quantum;
+};
+
+static inline struct scull_share **scull_share_bucket(void *q)
+{
+    return &scull_share_hash[hash_long((unsigned long)q, SCULL_SHARE_BITS)];
+}
+
+// 查找q的表项, 调用者持有scull_share_lock
+static struct scull_share **scull_share_find(void *q)
+{
+    struct scull_share **pp;
+
+    for (pp = scull_share_bucket(q); *pp; pp = &(*pp)->next)
+        if ((*pp)->q == q)
+            break;
+    return pp;
+}
+
+// 增加一个引用
+int scull_share_get(void *q)
+{
+    struct scull_share *sh, *new;
+    struct scull_share **pp;
+
+    // 在锁外申请表项, 不需要时释放
+    new = kmalloc(sizeof(struct scull_share), GFP_KERNEL);
+    spin_lock(&scull_share_lock);
+    pp = scull_share_find(q);
+    sh = *pp;
+    if (sh) {
+        sh->count++;
+    } else if (new) {
+        new->q = q;
+        new->count = 2;
+        new->next = NULL;
+        *pp = new;
+        atomic_inc(&scull_nr_shared);
+        new = NULL;
+    } else {
+        spin_unlock(&scull_share_lock);
+        return -ENOMEM;
+    }
+    spin_unlock(&scull_share_lock);
+    kfree(new);
+    return 0;
+}
+
+// 放弃一个引用, 返回非0表示这是最后一个引用, 调用者应释放量子
+static int scull_share_put(void *q)
+{
+    struct scull_share *sh, **pp;
+
+    if (!atomic_read(&scull_nr_shared))
+        return 1;
+    spin_lock(&scull_share_lock);
+    pp = scull_share_find(q);
+    sh = *pp;
+    if (!sh) {
+        spin_unlock(&scull_share_lock);
+        return 1;
+    }
+    if (--sh->count == 1) {
+        *pp = sh->next;
+        atomic_dec(&scull_nr_shared);
+    } else {
+        sh = NULL;
+    }
+    spin_unlock(&scull_share_lock);
+    kfree(sh);
+    return 0;
+}
+
+// 量子是否被多个设备引用
+int scull_quantum_shared(void *q)
+{
+    int shared;
+
+    if (!atomic_read(&scull_nr_shared))
+        return 0;
+    spin_lock(&scull_share_lock);
+    shared = *scull_share_find(q) != NULL;
+    spin_unlock(&scull_share_lock);
+    return shared;
+}
+
+/**
+ * dptr中第j个量子是否被共享, 调用者持有dptr->sem
+ * 共享位没有置位时不查表; 置位但量子已重新成为独占的(另一方写入或清空)时
+ * 清除共享位, 之后写入这个量子不再查表
+ */
+int scull_qset_quantum_shared(struct scull_qset *dptr, int qset, int j)
+{
+    unsigned long *shared = scull_qset_shared(dptr, qset);
+
+    if (!test_bit(j, shared))
+        return 0;
+    if (scull_quantum_real(dptr->data[j]) && scull_quantum_shared(dptr->data[j]))
+        return 1;
+    clear_bit(j, shared);
+    return 0;
+}
+
+/**
+ * 放弃设备对量子的引用, 最后一个引用时归还到量子池
+ * 调用者保证没有读者还在使用这个量子(已经过了宽限期)
+ * 每个引用共享量子的设备都把它计入自己的in_use, 不是最后一个引用时在这里扣除
+ * 压缩的量子不会被共享, 直接释放
+ */
+void scull_quantum_release(struct scull_dev *dev, void *q, int quantum)
+{
+    scull_zip_free(dev, q, quantum);
+    if (!scull_quantum_real(q))
+        return;
+    if (scull_share_put(q))
+        scull_pool_put_quantum(&dev->pool, q, quantum);
+    else
+        atomic_long_sub(quantum, &dev->pool.in_use);
+}
+
+// 工作队列函数: 放弃被替换下的共享量子的引用
+static void scull_cow_drop_work(void *data)
+{
+    struct scull_cow_drop *drop = data;
+
+    scull_quantum_release(drop->dev, drop->q, drop->quantum);
+    kfree(drop);
+}
+
+// RCU回调运行在软中断上下文, 量子池的锁不能在这里获取
+static void scull_cow_drop_rcu(struct rcu_head *head)
+{
+    struct scull_cow_drop *drop = container_of(head, struct scull_cow_drop, rcu);
+
+    queue_work(scull_wq, &drop->work);
+}
+
+/**
+ * 把dptr中第s_pos个共享的量子替换为私有的副本, 返回副本
+ * 调用者持有dptr->sem. 旧量子在宽限期后放弃引用,
+ * 无法申请延迟释放的结构时就地等待宽限期
+ */
+void *scull_cow(struct scull_dev *dev, struct scull_qset *dptr, int s_pos,
+                int quantum)
+{
+    void *old = dptr->data[s_pos], *q;
+    struct scull_cow_drop *drop;
+
+    q = scull_pool_get_quantum(&dev->pool, quantum);
+    if (!q) {
+        scull_stat_alloc_fail(dev);
+        return NULL;
+    }
+    memcpy(q, old, quantum);
+    rcu_assign_pointer(dptr->data[s_pos], q);
+    scull_stat_cow(dev);
+
+    drop = kmalloc(sizeof(struct scull_cow_drop), GFP_KERNEL);
+    if (!drop) {
+        synchronize_rcu();
+        scull_quantum_release(dev, old, quantum);
+        return q;
+    }
+    drop->dev = dev;
+    drop->q = old;
+    drop->quantum = quantum;
+    INIT_WORK(&drop->work, scull_cow_drop_work, drop);
+    call_rcu(&drop->rcu, scull_cow_drop_rcu);
+    return q;
+}
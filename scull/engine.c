@@ -0,0 +1,1613 @@
+/*
+ * engine.c -- scull的存储引擎
+ * 量子集索引的建立和查找, 读写复制循环, 预分配和打洞, 几何参数重整
+ * 以及trim. 这里不涉及file结构和字符设备, 读写以scull_dev为参数,
+ * 由main.c中的文件操作包装. 所有内核接口经由shim.h访问, 不定义
+ * __KERNEL__时本文件与pool.c, cow.c, tier.c, zip.c, shim.c一起编译成用户空间程序,
+ * 用于在没有内核模块的情况下做微基准测试和性能剖析(见enginebench.c)
+ */
+
+#include "shim.h"
+#include "scull.h"
+
+#define CREATE_TRACE_POINTS
+#include "trace.h"
+
+// 释放一个已经不再被任何读者引用的索引及其下的全部量子
+static void scull_free_index(struct scull_dev *dev, struct scull_index *idx)
+{
+    struct scull_qset *dptr;
+    int i, j;
+
+    for (i = 0; i < idx->nitems; i++) {
+        dptr = idx->items[i];
+        if (!dptr)
+            continue;
+        // 等待仍在该量子集上写入的写者完成
+        down(&dptr->sem);
+        up(&dptr->sem);
+        // 与快照共享的量子只放弃引用
+        for (j = 0; j < idx->qset; j++)
+            scull_quantum_release(dev, dptr->data[j], idx->quantum);
+        scull_qset_free(dptr, idx->qset);
+        cond_resched();     // 释放大设备可能需要很长时间
+    }
+    kfree(idx);
+}
+
+// 工作队列函数: 在进程上下文中释放被摘下的索引
+static void scull_free_index_work(void *data)
+{
+    struct scull_index *idx = data;
+
+    scull_free_index(idx->dev, idx);
+}
+
+// RCU回调: 读者已不再引用旧索引, 释放过程需要睡眠, 交给工作队列完成
+static void scull_index_retire_rcu(struct rcu_head *head)
+{
+    struct scull_index *idx = container_of(head, struct scull_index, rcu);
+
+    queue_work(scull_wq, &idx->free_work);
+}
+
+/**
+ * 清理struct scull_dev结构
+ * 只是以O(1)的代价摘下旧数据, 宽限期过后由scull_wq在后台释放,
+ * 调用者(如以只写方式打开设备)无需等待数百万个量子被逐个释放
+ */
+int scull_trim(struct scull_dev *dev)
+{
+    struct scull_index *idx = dev->data;
+    unsigned long size = dev->size;
+    u64 start = scull_now(), ns;
+
+    // 仍有活动的映射, 不能释放量子
+    if (atomic_read(&dev->vmas)) {
+        trace_scull_trim(SCULL_MINOR(dev), size, -EBUSY, scull_now() - start);
+        return -EBUSY;
+    }
+    // 日志模式下挡住新的追加; 已预留的追加未提交时不能清空
+    if (dev->log_mode) {
+        dev->log_frozen++;
+        smp_mb();
+        if (atomic_read(&dev->log_inflight)) {
+            dev->log_frozen--;
+            wake_up(&dev->log_wait);
+            trace_scull_trim(SCULL_MINOR(dev), size, -EBUSY, scull_now() - start);
+            return -EBUSY;
+        }
+        atomic_long_set(&dev->log_tail, 0);
+    }
+
+    // 先摘下索引, 之后进入的读者看到的是空设备
+    rcu_assign_pointer(dev->data, NULL);
+    spin_lock(&dev->lock);
+    dev->size = 0;
+    dev->gen++;
+    dev->ckpt_stale = 1;
+    // 没有设置自己几何参数的设备使用当前的全局参数
+    if (!dev->own_geom) {
+        dev->want_quantum = scull_quantum;
+        dev->want_qset = scull_qset;
+    }
+    dev->quantum = dev->want_quantum;
+    dev->qset = dev->want_qset;
+    spin_unlock(&dev->lock);
+    if (dev->log_mode) {
+        smp_wmb();
+        dev->log_frozen--;
+        wake_up(&dev->log_wait);
+    }
+    if (idx) {
+        // 等待仍在使用旧索引的读者离开后再释放
+        INIT_WORK(&idx->free_work, scull_free_index_work, idx);
+        call_rcu(&idx->rcu, scull_index_retire_rcu);
+    }
+    ns = scull_now() - start;
+    scull_stat_op(dev, SCULL_OP_TRIM, 0, 0, ns);
+    trace_scull_trim(SCULL_MINOR(dev), size, 0, ns);
+    return 0;
+}
+
+// 几何参数是否可用
+static int scull_geom_valid(int quantum, int qset)
+{
+    return quantum >= SCULL_QUANTUM_MIN && qset > 0 &&
+            qset <= SCULL_QSET_MAX && qset <= LONG_MAX / quantum;
+}
+
+// 申请一个空的索引数组
+static struct scull_index *scull_alloc_index(struct scull_dev *dev, int nitems,
+                                            int quantum, int qset)
+{
+    size_t bytes = sizeof(struct scull_index) +
+                    nitems * sizeof(struct scull_qset *);
+    struct scull_index *idx = kmalloc(bytes, GFP_KERNEL);
+
+    if (!idx)
+        return NULL;
+    memset(idx, 0, bytes);
+    idx->dev = dev;
+    idx->quantum = quantum;
+    idx->qset = qset;
+    idx->nitems = nitems;
+    return idx;
+}
+
+/**
+ * 把一段数据复制到尚未发布的新索引中, 按需创建量子集和量子
+ * 新索引只有重整者可见, 无需加锁
+ */
+static int scull_reshape_copy(struct scull_dev *dev, struct scull_index *idx,
+                                loff_t pos, const char *src, long len)
+{
+    long itemsize = (long)idx->quantum * idx->qset;
+    struct scull_qset *dptr;
+    int item, s_pos, q_pos;
+    long rest, chunk;
+    char *q;
+
+    while (len > 0) {
+        item = scull_split_pos(pos, itemsize, &rest);
+        s_pos = rest / idx->quantum;
+        q_pos = rest % idx->quantum;
+        chunk = min(len, (long)(idx->quantum - q_pos));
+
+        dptr = idx->items[item];
+        if (!dptr) {
+            dptr = scull_qset_alloc(idx->qset);
+            if (!dptr)
+                return -ENOMEM;
+            idx->items[item] = dptr;
+        }
+        q = dptr->data[s_pos];
+        if (!q) {
+            q = scull_pool_get_quantum(&dev->pool, idx->quantum);
+            if (!q)
+                return -ENOMEM;
+            if (!scull_quantum_paged(idx->quantum))
+                memset(q, 0, idx->quantum);
+            dptr->data[s_pos] = q;
+        }
+        memcpy(q + q_pos, src, chunk);
+        pos += chunk;
+        src += chunk;
+        len -= chunk;
+    }
+    return 0;
+}
+
+/**
+ * 按新的几何参数重建设备的数据, 调用者持有dev->sem
+ * 持有dev->sem时写者无法获得新的量子集, 对每个旧量子集获取一次信号量
+ * 即可等待已在其中的写者完成. 读者在此期间继续读取旧索引, 新索引
+ * 复制完成后一次性发布, 旧索引与trim一样在宽限期后由后台释放
+ * 复制整个量子而不按size截断, 写者是在释放量子集的锁之后才更新size的
+ */
+static int scull_reshape(struct scull_dev *dev, int quantum, int qset)
+{
+    struct scull_index *old = dev->data, *idx;
+    struct scull_qset *dptr;
+    long olditem, itemsize = (long)quantum * qset;
+    unsigned long end = 0;      // 设备大小是unsigned long, 避免64位除法
+    loff_t base;
+    int i, j, nitems = SCULL_INDEX_MIN, retval = 0;
+    void *q;
+
+    if (!old) {
+        dev->quantum = quantum;
+        dev->qset = qset;
+        return 0;
+    }
+    // 被映射的量子不能被替换
+    if (atomic_read(&dev->vmas))
+        return -EBUSY;
+
+    olditem = (long)old->quantum * old->qset;
+    for (i = 0; i < old->nitems; i++)
+        if (old->items[i])
+            end = (unsigned long)(i + 1) * olditem;
+    while (end && (end - 1) / itemsize >= nitems)
+        nitems *= 2;
+    idx = scull_alloc_index(dev, nitems, quantum, qset);
+    if (!idx)
+        return -ENOMEM;
+
+    for (i = 0; i < old->nitems && !retval; i++) {
+        dptr = old->items[i];
+        if (!dptr)
+            continue;
+        down(&dptr->sem);   // 等待仍在该量子集上写入的写者
+        for (j = 0; j < old->qset && !retval; j++) {
+            q = dptr->data[j];
+            base = (loff_t)i * olditem + (long)j * old->quantum;
+            // 换出或压缩的量子先调入, 新索引中的量子都在内存中
+            if (scull_quantum_cold(q)) {
+                q = scull_tier_load(dev, dptr, j, base, old->quantum, old->qset);
+                if (!q || IS_ERR(q)) {
+                    retval = q ? PTR_ERR(q) : -ENOMEM;
+                    break;
+                }
+            }
+            // 全0的量子在新索引中成为空洞, 读出的内容不变
+            if (!scull_quantum_real(q))
+                continue;
+            retval = scull_reshape_copy(dev, idx, base, q, old->quantum);
+        }
+        up(&dptr->sem);
+        cond_resched();
+    }
+    if (retval) {
+        scull_free_index(dev, idx);
+        return retval;
+    }
+
+    rcu_assign_pointer(dev->data, idx);
+    dev->quantum = quantum;
+    dev->qset = qset;
+    dev->ckpt_stale = 1;    // 数据的位置变了, 脏位图不再有意义
+    INIT_WORK(&old->free_work, scull_free_index_work, old);
+    call_rcu(&old->rcu, scull_index_retire_rcu);
+    return 0;
+}
+
+// 工作队列函数: 把设备重整为目标几何参数
+static void scull_reshape_work(void *data)
+{
+    struct scull_dev *dev = data;
+    int quantum, qset, retval = 0;
+
+    down(&dev->sem);
+    spin_lock(&dev->lock);
+    quantum = dev->want_quantum;
+    qset = dev->want_qset;
+    spin_unlock(&dev->lock);
+    if (quantum != dev->quantum || qset != dev->qset)
+        retval = scull_reshape(dev, quantum, qset);
+    if (retval) {
+        printk(KERN_NOTICE "scull: reshape to %i x %i failed (%i)\n",
+                quantum, qset, retval);
+        // 放弃这次重整, 让SCULL_IOCGGEOM反映实际的参数
+        spin_lock(&dev->lock);
+        if (dev->want_quantum == quantum && dev->want_qset == qset) {
+            dev->want_quantum = dev->quantum;
+            dev->want_qset = dev->qset;
+        }
+        spin_unlock(&dev->lock);
+    }
+    up(&dev->sem);
+}
+
+// 自动模式下选择不小于平均写入大小的量子
+static int scull_auto_quantum(unsigned long avg)
+{
+    int quantum = SCULL_AUTO_QMIN;
+
+    while (quantum < avg && quantum < SCULL_AUTO_QMAX)
+        quantum <<= 1;
+    return quantum;
+}
+
+/**
+ * 自动模式下记录一次写入的大小, 平均写入大小与目标量子相差4倍以上时
+ * 在后台重整. 相差不大时不调整, 避免在两种参数之间反复重整
+ */
+static void scull_geom_observe(struct scull_dev *dev, size_t count)
+{
+    int quantum, kick = 0;
+
+    count = min(count, (size_t)SCULL_AUTO_QMAX);
+    spin_lock(&dev->lock);
+    dev->wavg = dev->wavg ? (dev->wavg * 7 + count) / 8 : count;
+    if (++dev->nwrites % SCULL_AUTO_INTERVAL == 0) {
+        quantum = scull_auto_quantum(dev->wavg);
+        if (quantum / 4 >= dev->want_quantum || quantum * 4 <= dev->want_quantum) {
+            dev->want_quantum = quantum;
+            dev->want_qset = min(max(SCULL_AUTO_ITEM / quantum, 16),
+                                SCULL_QSET_MAX);
+            kick = 1;
+        }
+    }
+    spin_unlock(&dev->lock);
+    if (kick)
+        queue_work(scull_wq, &dev->reshape_work);
+}
+
+// 读取设备当前的几何参数, 以及是否还有未完成的重整
+void scull_get_geometry(struct scull_dev *dev, struct scull_geometry *geo)
+{
+    spin_lock(&dev->lock);
+    geo->quantum = dev->quantum;
+    geo->qset = dev->qset;
+    geo->flags = dev->auto_geom ? SCULL_GEOM_AUTO : 0;
+    if (dev->want_quantum != dev->quantum || dev->want_qset != dev->qset)
+        geo->flags |= SCULL_GEOM_RESHAPING;
+    spin_unlock(&dev->lock);
+}
+
+/**
+ * 设置设备自己的几何参数, 为0的项保持不变, 已有数据在后台重整
+ * SCULL_GEOM_AUTO 打开自动模式, 之后由写入大小决定参数
+ */
+int scull_set_geometry(struct scull_dev *dev, const struct scull_geometry *geo)
+{
+    int quantum, qset;
+
+    if (geo->flags & ~SCULL_GEOM_AUTO)
+        return -EINVAL;
+
+    spin_lock(&dev->lock);
+    quantum = geo->quantum ? geo->quantum : dev->want_quantum;
+    qset = geo->qset ? geo->qset : dev->want_qset;
+    if (!scull_geom_valid(quantum, qset)) {
+        spin_unlock(&dev->lock);
+        return -EINVAL;
+    }
+    dev->want_quantum = quantum;
+    dev->want_qset = qset;
+    dev->own_geom = 1;
+    dev->auto_geom = geo->flags & SCULL_GEOM_AUTO;
+    dev->wavg = dev->nwrites = 0;
+    spin_unlock(&dev->lock);
+
+    queue_work(scull_wq, &dev->reshape_work);
+    return 0;
+}
+
+/**
+ * 快照: 让dst成为src当前内容的副本, dst原有的数据被清空
+ * 两个设备共享所有量子, 任何一方写入时才复制(见cow.c), 代价只与
+ * 量子数成正比. 每个量子集在其信号量保护下复制, 其中正在进行的写入
+ * 要么完整地包含在快照中, 要么完全不包含
+ */
+int scull_snapshot(struct scull_dev *src, struct scull_dev *dst)
+{
+    struct scull_dev *first = src < dst ? src : dst;
+    struct scull_dev *second = src < dst ? dst : src;
+    struct scull_index *old, *idx = NULL;
+    struct scull_qset *sq, *dq;
+    unsigned long size;
+    int i, j, retval = 0;
+    void *q;
+
+    if (src == dst)
+        return -EINVAL;
+    // 按地址顺序获取两个设备的信号量, 相反方向的快照不会互相等待
+    if (down_interruptible(&first->sem))
+        return -ERESTARTSYS;
+    if (down_interruptible(&second->sem)) {
+        up(&first->sem);
+        return -ERESTARTSYS;
+    }
+    // 映射的页被直接写入, 不能共享; dst的映射也使scull_trim失败
+    // 日志模式的dst有自己的追加位置, 不能被整体替换
+    if (atomic_read(&src->vmas) || atomic_read(&dst->vmas) || dst->log_mode) {
+        retval = -EBUSY;
+        goto out;
+    }
+
+    // 先读大小, 此后才写入的数据即使被复制也不在大小之内
+    spin_lock(&src->lock);
+    size = src->size;
+    spin_unlock(&src->lock);
+    old = src->data;
+    if (old) {
+        idx = scull_alloc_index(dst, old->nitems, old->quantum, old->qset);
+        if (!idx) {
+            retval = -ENOMEM;
+            goto out;
+        }
+    }
+    for (i = 0; old && i < old->nitems && !retval; i++) {
+        sq = old->items[i];
+        if (!sq)
+            continue;
+        dq = scull_qset_alloc(old->qset);
+        if (!dq) {
+            retval = -ENOMEM;
+            break;
+        }
+        idx->items[i] = dq;
+        down(&sq->sem);     // 等待仍在该量子集上写入的写者
+        for (j = 0; j < old->qset; j++) {
+            q = sq->data[j];
+            // 交换文件和压缩的数据属于src, 先调入再共享
+            if (scull_quantum_cold(q)) {
+                q = scull_tier_load(src, sq, j, (loff_t)i * old->quantum * old->qset +
+                                    (loff_t)j * old->quantum, old->quantum, old->qset);
+                if (!q || IS_ERR(q)) {
+                    retval = q ? PTR_ERR(q) : -ENOMEM;
+                    break;
+                }
+            }
+            if (scull_quantum_real(q)) {
+                if (scull_share_get(q)) {
+                    retval = -ENOMEM;
+                    break;
+                }
+                // 共享的量子计入每个引用它的设备
+                atomic_long_add(old->quantum, &dst->pool.in_use);
+                set_bit(j, scull_qset_shared(sq, old->qset));
+                set_bit(j, scull_qset_shared(dq, old->qset));
+            }
+            dq->data[j] = q;
+        }
+        up(&sq->sem);
+        cond_resched();
+    }
+    if (retval) {
+        // 放弃已经获取的引用, 量子仍属于src
+        scull_free_index(dst, idx);
+        goto out;
+    }
+
+    scull_trim(dst);        // 上面已检查过映射和日志模式, 不会失败
+    rcu_assign_pointer(dst->data, idx);
+    smp_wmb();
+    spin_lock(&dst->lock);
+    dst->size = size;
+    if (idx) {
+        // 目标参数与数据一致, 之后的trim和重整不会改回dst原来的参数
+        dst->quantum = dst->want_quantum = idx->quantum;
+        dst->qset = dst->want_qset = idx->qset;
+    }
+    spin_unlock(&dst->lock);
+out:
+    up(&second->sem);
+    up(&first->sem);
+    return retval;
+}
+
+// 初始化设备结构中的几何参数和锁, 数据区为空
+void scull_dev_init(struct scull_dev *dev)
+{
+    dev->quantum = dev->want_quantum = scull_quantum;
+    dev->qset = dev->want_qset = scull_qset;
+    dev->ckpt_stale = 1;
+    init_MUTEX(&dev->sem);
+    spin_lock_init(&dev->lock);
+    atomic_set(&dev->vmas, 0);
+    atomic_set(&dev->log_inflight, 0);
+    atomic_set(&dev->writers, 0);
+    atomic_long_set(&dev->log_tail, 0);
+    init_waitqueue_head(&dev->log_wait);
+    scull_pool_init(&dev->pool);
+    scull_tier_init(dev);
+    scull_zip_init(dev);
+    INIT_WORK(&dev->reshape_work, scull_reshape_work, dev);
+    scull_stats_init(dev);
+}
+
+// 释放设备的全部内存, 卸载模块时调用
+void scull_dev_cleanup(struct scull_dev *dev)
+{
+    dev->auto_geom = 0;
+    scull_tier_stop(dev);       // 不再换出
+    scull_zip_stop(dev);        // 不再压缩
+    if (scull_wq)
+        flush_workqueue(scull_wq);  // 等待尚未完成的重整, 换出和压缩
+    scull_trim(dev);
+    rcu_barrier();              // 等待已提交的RCU回调
+    if (scull_wq)
+        flush_workqueue(scull_wq);  // 等待后台释放结束
+    flush_scheduled_work();     // 等待量子池的补充工作结束
+    scull_pool_drain(&dev->pool);
+    scull_tier_release(dev);
+    scull_zip_release(dev);
+    scull_stats_free(dev);
+}
+
+
+// RCU回调, 释放被替换下来的旧索引数组(其中的量子集仍在新数组中)
+static void scull_index_free_rcu(struct rcu_head *head)
+{
+    kfree(container_of(head, struct scull_index, rcu));
+}
+
+// 扩展量子集索引数组, 使其至少能容纳第n项, 调用者持有dev->sem
+static int scull_grow_index(struct scull_dev *dev, int n)
+{
+    struct scull_index *old = dev->data, *idx;
+    int nitems = old ? old->nitems : SCULL_INDEX_MIN;
+
+    while (nitems <= n)
+        nitems *= 2;
+    idx = scull_alloc_index(dev, nitems, dev->quantum, dev->qset);
+    if (!idx)
+        return -ENOMEM;
+    if (old)
+        memcpy(idx->items, old->items, old->nitems * sizeof(struct scull_qset *));
+
+    // 发布新数组, 旧数组可能仍有读者, 宽限期后再释放
+    rcu_assign_pointer(dev->data, idx);
+    if (old)
+        call_rcu(&old->rcu, scull_index_free_rcu);
+    return 0;
+}
+
+// 到达指定位置, 以项号直接索引, 不再逐项遍历链表, 调用者持有dev->sem
+struct scull_qset *scull_follow(struct scull_dev *dev, int n)
+{
+    struct scull_qset *qs;
+    int nitems = dev->data ? dev->data->nitems : 0, hops = 0, created = 0;
+
+    // 如果需要则扩展索引数组
+    if (n >= nitems) {
+        if (scull_grow_index(dev, n))
+            return NULL;
+        // 记录扩展了几倍, 第一次建立索引算作一次
+        for (hops = 1; nitems && (nitems <<= 1) < dev->data->nitems; hops++)
+            ;
+    }
+
+    // 如果需要则申请一块内存
+    qs = dev->data->items[n];
+    if (!qs) {
+        qs = scull_qset_alloc(dev->data->qset);
+        if (qs == NULL)
+            return NULL;
+        rcu_assign_pointer(dev->data->items[n], qs);
+        created = 1;
+    }
+    trace_scull_follow(SCULL_MINOR(dev), n, hops, created);
+    return qs;
+}
+
+/**
+ * 查找pos所在的量子, 位于空洞或全0量子时返回NULL, *q_pos返回量子内的偏移
+ * 量子被换出或压缩时原样返回(见scull_quantum_cold), 调用者离开临界区后用
+ * scull_tier_fault调入再重新查找
+ * 调用者处于RCU读临界区, 或者持有dev->sem
+ */
+char *scull_lookup(struct scull_index *idx, loff_t pos, int *q_pos)
+{
+    long itemsize = (long)idx->quantum * idx->qset, rest;
+    int item = scull_split_pos(pos, itemsize, &rest);
+    int s_pos = rest / idx->quantum;
+    struct scull_qset *dptr;
+    void *q;
+
+    *q_pos = rest % idx->quantum;
+    if (item >= idx->nitems)
+        return NULL;
+    dptr = rcu_dereference(idx->items[item]);
+    if (!dptr)
+        return NULL;
+    q = rcu_dereference(dptr->data[s_pos]);
+    if (!scull_quantum_real(q))
+        return scull_quantum_cold(q) ? q : NULL;
+    scull_tier_touch(idx->dev, dptr, s_pos, idx->qset);
+    return q;
+}
+
+// 跳过iovec中已经用完(或长度为0)的段, 调用者保证后面还有未用完的段
+static inline void scull_iov_next(const struct iovec **iov, size_t *iov_off)
+{
+    while (*iov_off == (*iov)->iov_len) {
+        (*iov)++;
+        *iov_off = 0;
+    }
+}
+
+/**
+ * 分散读取, 一次调用可以跨越多个量子, 量子集以及iovec的多个段
+ * 读者不获取dev->sem, 而是在RCU保护下查找量子, 因此读者之间
+ * 以及读者与写者之间互不阻塞. 量子只会在宽限期之后才被释放
+ * 每复制SCULL_READ_BATCH字节离开一次临界区, 之后重新查找
+ * 设备大小以内的空洞读出0
+ */
+ssize_t scull_dev_readv(struct scull_dev *dev, const struct iovec *iov,
+                        unsigned long nr_segs, loff_t *f_pos)
+{
+    struct scull_index *idx;
+    char __user *ubuf;
+    char *q;
+    int q_pos;
+    size_t want = iov_length(iov, nr_segs), count = want;
+    size_t done = 0, iov_off = 0, chunk, left, held;
+    unsigned long size;
+    loff_t pos = *f_pos;
+    ssize_t retval = 0;
+    u64 start = scull_now(), ns;
+
+    PDEBUG("read some data\n");
+    rcu_read_lock();
+again:
+    held = 0;
+    size = dev->size;
+    smp_rmb();  // 与scull_writev中的smp_wmb配对, 保证size以内的数据可见
+    idx = rcu_dereference(dev->data);
+    if (!idx || pos >= size)
+        goto out;
+    if (pos + (count - done) > size)
+        count = done + (size - pos);
+
+    while (done < count) {
+        // 到达指定的位置
+        q = scull_lookup(idx, pos, &q_pos);
+        if (scull_quantum_cold(q)) {
+            // 量子已换出或压缩: 离开临界区调入后重新查找
+            rcu_read_unlock();
+            retval = scull_tier_fault(dev, pos);
+            if (retval)
+                goto fault;
+            rcu_read_lock();
+            goto again;
+        }
+
+        // 本次最多读到量子末尾或当前段末尾; 临界区内不能睡眠, 不处理缺页
+        scull_iov_next(&iov, &iov_off);
+        ubuf = iov->iov_base + iov_off;
+        chunk = min(count - done, (size_t)(idx->quantum - q_pos));
+        chunk = min(chunk, iov->iov_len - iov_off);
+        if (q) {
+            left = __copy_to_user_inatomic(ubuf, q + q_pos, chunk);
+        } else {
+            // 空洞: 从零页复制, 不申请内存
+            chunk = min(chunk, (size_t)PAGE_SIZE);
+            left = __copy_to_user_inatomic(ubuf,
+                                page_address(ZERO_PAGE(0)), chunk);
+        }
+        done += chunk - left;
+        pos += chunk - left;
+        iov_off += chunk - left;
+        if (left) {
+            // 用户缓冲区缺页: 离开临界区处理后重新查找
+            rcu_read_unlock();
+            if (fault_in_pages_writeable(ubuf + chunk - left,
+                                min(left, (size_t)PAGE_SIZE))) {
+                if (!done)
+                    retval = -EFAULT;
+                goto fault;
+            }
+            rcu_read_lock();
+            goto again;
+        }
+        // 长的读取不能一直关闭抢占, 也不能拖住trim和写时复制的宽限期
+        held += chunk;
+        if (held >= SCULL_READ_BATCH && done < count) {
+            rcu_read_unlock();
+            cond_resched();
+            rcu_read_lock();
+            goto again;
+        }
+    }
+out:
+    rcu_read_unlock();
+fault:
+    if (done)
+        retval = done;
+    ns = scull_now() - start;
+    scull_stat_op(dev, SCULL_OP_READ, want, retval, ns);
+    trace_scull_read(SCULL_MINOR(dev), *f_pos, want, retval, ns);
+    *f_pos += done;
+    return retval;
+}
+
+
+/**
+ * 检查一段内存是否全为0
+ * 按字比较, 每次取4个字按位或后判断, 编译器可以把循环体向量化;
+ * 写入的数据通常在开头就不是0, 此时第一次比较即返回
+ */
+static int scull_mem_zero(const void *p, size_t len)
+{
+    const unsigned char *c = p;
+    const unsigned long *w;
+
+    for (; len && ((unsigned long)c & (sizeof(long) - 1)); len--)
+        if (*c++)
+            return 0;
+    w = (const unsigned long *)c;
+    for (; len >= 4 * sizeof(long); len -= 4 * sizeof(long), w += 4)
+        if (w[0] | w[1] | w[2] | w[3])
+            return 0;
+    for (; len >= sizeof(long); len -= sizeof(long))
+        if (*w++)
+            return 0;
+    for (c = (const unsigned char *)w; len; len--)
+        if (*c++)
+            return 0;
+    return 1;
+}
+
+/**
+ * 定位pos所在的量子集并获取它的信号量, 返回时已经释放了dev->sem
+ * create为0时不创建缺失的量子集而是返回NULL; 否则返回NULL表示内存不足
+ * 只有这一步需要设备级的锁, 锁的顺序总是先dev->sem后量子集的sem
+ */
+struct scull_qset *scull_get_qset(struct scull_dev *dev, loff_t pos,
+                                int create, struct scull_geom *g)
+{
+    struct scull_qset *dptr = NULL;
+    u64 start = scull_now();
+    int item;
+
+    if (down_interruptible(&dev->sem))
+        return ERR_PTR(-ERESTARTSYS);
+    scull_stat_sem_wait(dev, start);
+    g->gen = dev->gen;
+    g->quantum = dev->quantum;
+    g->qset = dev->qset;
+    g->itemsize = (long)g->quantum * g->qset;
+    item = scull_split_pos(pos, g->itemsize, &g->rest);
+
+    if (create)
+        dptr = scull_follow(dev, item);
+    else if (dev->data && item < dev->data->nitems)
+        dptr = dev->data->items[item];
+    if (dptr)
+        down(&dptr->sem);   // 先锁住量子集再释放设备锁
+    else if (create)
+        scull_stat_alloc_fail(dev);
+    up(&dev->sem);
+    return dptr;
+}
+
+// 写入完成后扩展设备大小, 期间设备被清空过则不修改
+static void scull_extend_size(struct scull_dev *dev, unsigned long gen,
+                                loff_t end)
+{
+    // 先让数据对读者可见, 再更新大小
+    smp_wmb();
+    spin_lock(&dev->lock);
+    if (dev->gen == gen && dev->size < end)
+        dev->size = end;
+    spin_unlock(&dev->lock);
+}
+
+/**
+ * 把iovec中的count字节写到pos处, 按需申请缺失的量子集和量子
+ * 只有定位或创建量子集时才获取设备级的dev->sem, 复制数据时只持有
+ * 当前量子集的信号量, 因此写入不同量子集的写者可以并行执行.
+ * 落在同一量子集内的多个段只获取一次锁
+ * 返回写入的字节数, 一个字节也没有写入时返回错误码; *gen返回写入时设备的代号
+ */
+static ssize_t scull_copy_in(struct scull_dev *dev, const struct iovec *iov,
+                            loff_t pos, size_t count, unsigned long *gen)
+{
+    struct scull_qset *dptr;    // 当前量子集
+    struct scull_geom g;
+    char *q, *old;
+    int s_pos, q_pos, fresh;
+    size_t done = 0, iov_off = 0, chunk;
+    ssize_t retval = 0;
+
+    while (done < count) {
+        // 结构性操作: 定位(必要时创建)量子集
+        dptr = scull_get_qset(dev, pos, 1, &g);
+        if (IS_ERR(dptr)) {
+            retval = PTR_ERR(dptr);
+            break;
+        }
+        if (dptr == NULL) {
+            retval = -ENOMEM;
+            break;
+        }
+        // 写入过程中设备被清空则停止
+        if (done && g.gen != *gen) {
+            up(&dptr->sem);
+            break;
+        }
+        *gen = g.gen;
+
+        // 只持有量子集的锁, 写到本量子集末尾为止
+        while (done < count && g.rest < g.itemsize) {
+            s_pos = g.rest / g.quantum;
+            q_pos = g.rest % g.quantum;
+            // 本次最多写到量子末尾或当前段末尾
+            scull_iov_next(&iov, &iov_off);
+            chunk = min(count - done, (size_t)(g.quantum - q_pos));
+            chunk = min(chunk, iov->iov_len - iov_off);
+
+            q = old = dptr->data[s_pos];
+            // 换出或压缩的量子被整个覆盖时不必调入, 否则先调入以保留其余的内容
+            if (scull_quantum_cold(q) && chunk < g.quantum) {
+                q = scull_tier_load(dev, dptr, s_pos, pos - q_pos, g.quantum,
+                                    g.qset);
+                if (!q || IS_ERR(q)) {
+                    retval = q ? PTR_ERR(q) : -ENOMEM;
+                    break;
+                }
+            } else if (scull_quantum_real(q)) {
+                scull_tier_touch(dev, dptr, s_pos, g.qset);
+            }
+            fresh = !scull_quantum_real(q);
+            if (fresh) {
+                q = scull_pool_get_quantum(&dev->pool, g.quantum);
+                if (!q) {
+                    scull_stat_alloc_fail(dev);
+                    retval = -ENOMEM;
+                    break;
+                }
+                // 新量子中不会被本次写入覆盖的部分必须读出0
+                if (!scull_quantum_paged(g.quantum)) {
+                    memset(q, 0, q_pos);
+                    memset(q + q_pos + chunk, 0, g.quantum - q_pos - chunk);
+                }
+            } else if (scull_qset_quantum_shared(dptr, g.qset, s_pos)) {
+                // 与快照共享的量子, 先复制一份再写
+                q = scull_cow(dev, dptr, s_pos, g.quantum);
+                if (!q) {
+                    retval = -ENOMEM;
+                    break;
+                }
+            }
+            if (copy_from_user(q + q_pos, iov->iov_base + iov_off, chunk)) {
+                if (fresh)
+                    scull_pool_put_quantum(&dev->pool, q, g.quantum);
+                retval = -EFAULT;
+                break;
+            }
+            // 新量子在写满数据后才对读者发布, 全0时改用标记
+            if (fresh && !atomic_read(&dev->vmas) &&
+                    scull_mem_zero(q + q_pos, chunk)) {
+                scull_pool_put_quantum(&dev->pool, q, g.quantum);
+                if (dptr->data[s_pos] != SCULL_ZERO_QUANTUM) {
+                    rcu_assign_pointer(dptr->data[s_pos], SCULL_ZERO_QUANTUM);
+                    scull_stat_zero_dedup(dev);
+                }
+            } else if (fresh) {
+                rcu_assign_pointer(dptr->data[s_pos], q);
+                scull_tier_touch(dev, dptr, s_pos, g.qset);
+            }
+            // 被整个覆盖的压缩量子不再被引用
+            if (fresh)
+                scull_zip_free(dev, old, g.quantum);
+            set_bit(s_pos, scull_qset_dirty(dptr, g.qset));
+            done += chunk;
+            pos += chunk;
+            g.rest += chunk;
+            iov_off += chunk;
+        }
+        up(&dptr->sem);
+        if (retval)
+            break;
+    }
+    // 只要写入了数据就返回已写入的字节数
+    return done ? done : retval;
+}
+
+// 普通写入结束; 最后一个写者唤醒等待进入日志模式的scull_set_log
+static void scull_writer_done(struct scull_dev *dev)
+{
+    if (atomic_dec_and_test(&dev->writers) && dev->log_mode)
+        wake_up(&dev->log_wait);
+}
+
+// 集中写入, 一次调用写完所有iovec段
+ssize_t scull_dev_writev(struct scull_dev *dev, const struct iovec *iov,
+                        unsigned long nr_segs, loff_t *f_pos)
+{
+    size_t count = iov_length(iov, nr_segs);
+    unsigned long gen = 0;
+    ssize_t retval;
+    u64 start = scull_now(), ns;
+
+    PDEBUG("write some data\n");
+    // 与scull_set_log配对: 要么这里看到日志模式, 要么set_log等到本次写入结束
+    atomic_inc(&dev->writers);
+    smp_mb();
+    if (dev->log_mode) {
+        scull_writer_done(dev);
+        return -EPERM;
+    }
+    retval = scull_copy_in(dev, iov, *f_pos, count, &gen);
+    if (retval > 0) {
+        scull_extend_size(dev, gen, *f_pos + retval);
+        if (dev->auto_geom)
+            scull_geom_observe(dev, retval);
+    }
+    scull_writer_done(dev);
+    ns = scull_now() - start;
+    scull_stat_op(dev, SCULL_OP_WRITE, count, retval, ns);
+    trace_scull_write(SCULL_MINOR(dev), *f_pos, count, retval, ns);
+    if (retval > 0)
+        *f_pos += retval;
+    scull_tier_check(dev);
+    return retval;
+}
+
+/**
+ * 提交已写完的预留范围[start, end)
+ * 之前的预留都已提交时推进水位(即dev->size)并唤醒poll的读者, 顺便提交
+ * 紧接其后已经完成的范围; 否则把范围记入按起点排序的待提交链表,
+ * 由推进到它的写者一并提交. r由调用者预先申请, 不需要时在这里释放
+ */
+static void scull_log_commit(struct scull_dev *dev, unsigned long start,
+                            unsigned long end, struct scull_log_range *r)
+{
+    struct scull_log_range **pp, *p, *done = r;
+
+    // 先让数据对读者可见, 再推进水位
+    smp_wmb();
+    spin_lock(&dev->lock);
+    if (dev->size != start) {
+        for (pp = &dev->log_pending; *pp && (*pp)->start < start;
+                pp = &(*pp)->next)
+            ;
+        r->start = start;
+        r->end = end;
+        r->next = *pp;
+        *pp = r;
+        spin_unlock(&dev->lock);
+        return;
+    }
+    dev->size = end;
+    r->next = NULL;
+    while ((p = dev->log_pending) != NULL && p->start == dev->size) {
+        dev->size = p->end;
+        dev->log_pending = p->next;
+        p->next = done;
+        done = p;
+    }
+    spin_unlock(&dev->lock);
+    wake_up_interruptible(&dev->log_wait);
+
+    for (; done; done = p) {
+        p = done->next;
+        kfree(done);
+    }
+}
+
+/**
+ * 日志模式下的追加写入
+ * 写者以原子加在log_tail上预留一段范围, 不获取dev->sem或dev->lock,
+ * 之后与普通写入一样并行地复制到各自的量子中, 完成后由scull_log_commit
+ * 按顺序推进水位. 读者只能读到水位以内的数据, 看不到尚未写完的记录
+ * 复制失败时也提交整个范围(未写入的部分读出0), 否则水位会永远停在这里
+ */
+ssize_t scull_dev_append(struct scull_dev *dev, const struct iovec *iov,
+                        unsigned long nr_segs, loff_t *f_pos)
+{
+    struct scull_log_range *r;
+    size_t count = iov_length(iov, nr_segs);
+    unsigned long gen = 0, pos;
+    ssize_t retval;
+    u64 start = scull_now(), ns;
+
+    if (!count)
+        return 0;
+    // 预留之后不能失败, 待提交链表的节点在预留前申请
+    r = kmalloc(sizeof(struct scull_log_range), GFP_KERNEL);
+    if (!r)
+        return -ENOMEM;
+
+    // 与scull_trim配对: 要么这里看到log_frozen, 要么trim看到log_inflight
+    for (;;) {
+        atomic_inc(&dev->log_inflight);
+        smp_mb();
+        if (!dev->log_frozen)
+            break;
+        atomic_dec(&dev->log_inflight);
+        wait_event(dev->log_wait, !dev->log_frozen);
+    }
+    // 与scull_set_log(0)配对: 它在dev->lock下检查log_inflight后才关闭日志模式,
+    // 这里看到日志模式已关闭时撤回, 改为普通的追加写入
+    spin_lock(&dev->lock);
+    if (!dev->log_mode) {
+        spin_unlock(&dev->lock);
+        atomic_dec(&dev->log_inflight);
+        kfree(r);
+        *f_pos = dev->size;
+        return scull_dev_writev(dev, iov, nr_segs, f_pos);
+    }
+    spin_unlock(&dev->lock);
+    pos = atomic_long_add_return(count, &dev->log_tail) - count;
+
+    retval = scull_copy_in(dev, iov, pos, count, &gen);
+    scull_log_commit(dev, pos, pos + count, r);
+    atomic_dec(&dev->log_inflight);
+
+    if (retval > 0 && dev->auto_geom)
+        scull_geom_observe(dev, retval);
+    ns = scull_now() - start;
+    scull_stat_op(dev, SCULL_OP_WRITE, count, retval, ns);
+    trace_scull_write(SCULL_MINOR(dev), pos, count, retval, ns);
+    if (retval > 0)
+        *f_pos = pos + retval;
+    scull_tier_check(dev);
+    return retval;
+}
+
+/**
+ * 打开或关闭日志模式. 打开时不能有映射; 新的普通写入随即失败, 已经开始的
+ * 普通写入结束后才确定追加的起点(当前大小), 期间追加等待
+ * 等待时不能持有dev->sem, 普通写者定位量子集时还要获取它
+ * 关闭时不能有正在进行的追加
+ */
+int scull_set_log(struct scull_dev *dev, int on)
+{
+    struct scull_log_range *p, *pending = NULL;
+    int retval = 0;
+
+    if (down_interruptible(&dev->sem))
+        return -ERESTARTSYS;
+    if (on && !dev->log_mode && atomic_read(&dev->vmas)) {
+        retval = -EBUSY;
+    } else if (on && !dev->log_mode) {
+        dev->log_frozen++;
+        spin_lock(&dev->lock);
+        dev->log_mode = 1;
+        spin_unlock(&dev->lock);
+        smp_mb();
+        up(&dev->sem);
+        wait_event(dev->log_wait, !atomic_read(&dev->writers));
+        down(&dev->sem);
+        atomic_long_set(&dev->log_tail, dev->size);
+        smp_wmb();
+        dev->log_frozen--;
+        wake_up(&dev->log_wait);
+    } else if (!on && dev->log_mode) {
+        // 没有进行中的追加时所有预留都已提交, 待提交链表应当为空
+        spin_lock(&dev->lock);
+        if (atomic_read(&dev->log_inflight)) {
+            retval = -EBUSY;
+        } else {
+            dev->log_mode = 0;
+            pending = dev->log_pending;
+            dev->log_pending = NULL;
+        }
+        spin_unlock(&dev->lock);
+    }
+    up(&dev->sem);
+    WARN_ON(pending != NULL);
+    for (; pending; pending = p) {
+        p = pending->next;
+        kfree(pending);
+    }
+    return retval;
+}
+
+
+/**
+ * 预分配[offset, offset+len)范围内缺失的量子(内容为0), 之后写入这一范围
+ * 不再需要申请内存. SCULL_FALLOC_ZERO 同时把范围内已有的数据清零
+ */
+int scull_prealloc(struct scull_dev *dev, loff_t offset, loff_t len, int mode)
+{
+    struct scull_qset *dptr;
+    struct scull_geom g;
+    loff_t pos = offset, end = offset + len;
+    unsigned long gen = 0;
+    int s_pos, q_pos, chunk;
+    int retval = 0;
+    char *q;
+
+    // 日志模式的大小只由追加推进
+    if (dev->log_mode && !(mode & SCULL_FALLOC_KEEP_SIZE))
+        return -EPERM;
+    while (pos < end) {
+        dptr = scull_get_qset(dev, pos, 1, &g);
+        if (IS_ERR(dptr))
+            return PTR_ERR(dptr);
+        if (dptr == NULL)
+            return -ENOMEM;
+        if (pos != offset && g.gen != gen) {    // 期间设备被清空
+            up(&dptr->sem);
+            return -EAGAIN;
+        }
+        gen = g.gen;
+
+        while (pos < end && g.rest < g.itemsize) {
+            s_pos = g.rest / g.quantum;
+            q_pos = g.rest % g.quantum;
+            chunk = min(end - pos, (loff_t)(g.quantum - q_pos));
+            q = dptr->data[s_pos];
+            if (scull_quantum_cold(q)) {
+                q = scull_tier_load(dev, dptr, s_pos, pos - q_pos, g.quantum,
+                                    g.qset);
+                if (!q || IS_ERR(q)) {
+                    retval = q ? PTR_ERR(q) : -ENOMEM;
+                    break;
+                }
+            }
+            // 全0标记也换成真正的量子, 之后的写入不再申请内存
+            if (!q || q == SCULL_ZERO_QUANTUM) {
+                q = scull_pool_get_quantum(&dev->pool, g.quantum);
+                if (!q) {
+                    scull_stat_alloc_fail(dev);
+                    retval = -ENOMEM;
+                    break;
+                }
+                if (!scull_quantum_paged(g.quantum))
+                    memset(q, 0, g.quantum);
+                rcu_assign_pointer(dptr->data[s_pos], q);
+            } else if (mode & SCULL_FALLOC_ZERO) {
+                if (scull_qset_quantum_shared(dptr, g.qset, s_pos))
+                    q = scull_cow(dev, dptr, s_pos, g.quantum);
+                if (!q) {
+                    retval = -ENOMEM;
+                    break;
+                }
+                memset(q + q_pos, 0, chunk);
+                set_bit(s_pos, scull_qset_dirty(dptr, g.qset));
+            }
+            pos += chunk;
+            g.rest += chunk;
+        }
+        up(&dptr->sem);
+        if (retval)
+            return retval;
+    }
+
+    if (!(mode & SCULL_FALLOC_KEEP_SIZE))
+        scull_extend_size(dev, gen, end);
+    scull_tier_check(dev);
+    return 0;
+}
+
+// 等待读者离开后释放一批被摘下的量子
+static void scull_free_batch(struct scull_dev *dev, void **batch, int *nbatch,
+                                int quantum)
+{
+    int i;
+
+    if (!*nbatch)
+        return;
+    synchronize_rcu();
+    for (i = 0; i < *nbatch; i++)
+        scull_quantum_release(dev, batch[i], quantum);
+    *nbatch = 0;
+}
+
+/**
+ * 打洞: 释放[offset, offset+len)范围内完整的量子, 两端不完整的量子
+ * 只清零对应部分. 设备大小不变, 之后读这一范围得到0
+ * 被摘下的量子可能仍有RCU读者, 攒够一批后等待宽限期再释放
+ */
+int scull_punch_hole(struct scull_dev *dev, loff_t offset, loff_t len)
+{
+    struct scull_qset *dptr;
+    struct scull_geom g;
+    loff_t pos = offset, end = offset + len;
+    unsigned long gen = 0;
+    int s_pos, q_pos, chunk, nbatch = 0, quantum = 0;
+    int retval = 0;
+    void **batch;
+    char *q;
+
+    // 被映射的页不能释放
+    if (atomic_read(&dev->vmas))
+        return -EBUSY;
+    if (end > dev->size)
+        end = dev->size;
+    batch = kmalloc(SCULL_PUNCH_BATCH * sizeof(void *), GFP_KERNEL);
+    if (!batch)
+        return -ENOMEM;
+
+    while (pos < end) {
+        dptr = scull_get_qset(dev, pos, 0, &g);
+        if (IS_ERR(dptr)) {
+            retval = PTR_ERR(dptr);
+            break;
+        }
+        if (pos != offset && g.gen != gen) {    // 期间设备被清空, 无需继续
+            if (dptr)
+                up(&dptr->sem);
+            break;
+        }
+        gen = g.gen;
+        quantum = g.quantum;
+        if (!dptr) {
+            // 整个量子集都是空洞
+            pos += g.itemsize - g.rest;
+            continue;
+        }
+
+        while (pos < end && g.rest < g.itemsize) {
+            s_pos = g.rest / g.quantum;
+            q_pos = g.rest % g.quantum;
+            chunk = min(end - pos, (loff_t)(g.quantum - q_pos));
+            q = dptr->data[s_pos];
+            // 部分打洞时换出或压缩的量子先调入
+            if (scull_quantum_cold(q) && chunk < g.quantum) {
+                q = scull_tier_load(dev, dptr, s_pos, pos - q_pos, g.quantum,
+                                    g.qset);
+                if (!q || IS_ERR(q)) {
+                    retval = q ? PTR_ERR(q) : -ENOMEM;
+                    break;
+                }
+            }
+            if (q == SCULL_ZERO_QUANTUM) {
+                // 标记没有内存需要释放, 部分打洞时内容已经是0
+                if (chunk == g.quantum)
+                    rcu_assign_pointer(dptr->data[s_pos], NULL);
+            } else if (scull_quantum_cold(q)) {
+                // 交换文件中的内容不再被引用; 读者不解引用压缩的量子, 可以立即释放
+                rcu_assign_pointer(dptr->data[s_pos], NULL);
+                set_bit(s_pos, scull_qset_dirty(dptr, g.qset));
+                scull_zip_free(dev, q, g.quantum);
+            } else if (q && chunk == g.quantum) {
+                rcu_assign_pointer(dptr->data[s_pos], NULL);
+                set_bit(s_pos, scull_qset_dirty(dptr, g.qset));
+                batch[nbatch++] = q;
+                if (nbatch == SCULL_PUNCH_BATCH)
+                    scull_free_batch(dev, batch, &nbatch, quantum);
+            } else if (q) {
+                if (scull_qset_quantum_shared(dptr, g.qset, s_pos))
+                    q = scull_cow(dev, dptr, s_pos, g.quantum);
+                if (!q) {
+                    retval = -ENOMEM;
+                    break;
+                }
+                memset(q + q_pos, 0, chunk);
+                set_bit(s_pos, scull_qset_dirty(dptr, g.qset));
+            }
+            pos += chunk;
+            g.rest += chunk;
+        }
+        up(&dptr->sem);
+        if (retval)
+            break;
+    }
+    scull_free_batch(dev, batch, &nbatch, quantum);
+    kfree(batch);
+    return retval;
+}
+
+/**
+ * 经由内核缓冲区把src中从off_in开始的len字节写到dst的off_out处,
+ * 每次搬运SCULL_COPY_CHUNK字节, 数据不经过用户空间
+ * 返回复制的字节数, 一个字节也没有复制时返回错误码
+ */
+static ssize_t scull_copy_data(struct scull_dev *src, loff_t off_in,
+                                struct scull_dev *dst, loff_t off_out, size_t len)
+{
+    mm_segment_t old_fs;
+    struct iovec iov;
+    size_t done = 0;
+    ssize_t ret = 0;
+    loff_t pos;
+    char *buf;
+
+    if (!len)
+        return 0;
+    buf = vmalloc(min(len, (size_t)SCULL_COPY_CHUNK));
+    if (!buf)
+        return -ENOMEM;
+    old_fs = get_fs();
+    set_fs(KERNEL_DS);
+    while (done < len) {
+        iov.iov_base = (void __user *)buf;
+        iov.iov_len = min(len - done, (size_t)SCULL_COPY_CHUNK);
+        pos = off_in + done;
+        ret = scull_dev_readv(src, &iov, 1, &pos);
+        if (ret <= 0)
+            break;
+        iov.iov_len = ret;
+        pos = off_out + done;
+        ret = scull_dev_writev(dst, &iov, 1, &pos);
+        if (ret <= 0)
+            break;
+        done += ret;
+        cond_resched();
+    }
+    set_fs(old_fs);
+    vfree(buf);
+    return done ? done : ret;
+}
+
+// off是否按量子对齐, 32位内核上loff_t取余要用do_div
+static inline int scull_off_aligned(loff_t off, int quantum)
+{
+    u64 n = off;
+
+    return do_div(n, quantum) == 0;
+}
+
+/**
+ * 共享src中从off_in开始的完整量子, 放到dst的off_out处, 最多len字节
+ * 每次在src的一个量子集中为最多SCULL_PUNCH_BATCH个量子增加引用, 释放它的
+ * 锁之后再装入dst, 从不同时持有两个量子集的锁. 空洞和全0标记原样照搬,
+ * 换出或压缩的量子先在src中调入. dst中被替换下的量子等待宽限期后放弃引用
+ * 返回共享的字节数, 一个量子也没有共享时返回错误码; *gen返回dst的代号
+ */
+static ssize_t scull_reflink(struct scull_dev *src, loff_t off_in,
+                            struct scull_dev *dst, loff_t off_out, size_t len,
+                            unsigned long *gen)
+{
+    struct scull_qset *sq, *dq;
+    struct scull_geom gs, gd;
+    void **pin, **old, *q;
+    size_t done = 0;
+    int i, n, s_pos, quantum = 0, nold = 0;
+    ssize_t retval = 0;
+
+    pin = kmalloc(2 * SCULL_PUNCH_BATCH * sizeof(void *), GFP_KERNEL);
+    if (!pin)
+        return -ENOMEM;
+    old = pin + SCULL_PUNCH_BATCH;
+
+    while (!retval) {
+        // 在src的一个量子集中钉住一批量子
+        sq = scull_get_qset(src, off_in + done, 0, &gs);
+        if (IS_ERR(sq)) {
+            retval = PTR_ERR(sq);
+            break;
+        }
+        quantum = gs.quantum;
+        // 偏移必须按量子对齐; 期间src被重整时这里也会发现
+        if (!scull_off_aligned(off_in + done, quantum) ||
+                !scull_off_aligned(off_out + done, quantum))
+            retval = -EINVAL;
+        else if (sq && atomic_read(&src->vmas))
+            retval = -EBUSY;    // 映射的页被直接写入, 不能共享
+        n = 0;
+        for (s_pos = gs.rest / quantum; !retval && n < SCULL_PUNCH_BATCH &&
+                s_pos < gs.qset && done + (size_t)(n + 1) * quantum <= len; s_pos++) {
+            q = sq ? sq->data[s_pos] : NULL;
+            if (scull_quantum_cold(q)) {
+                q = scull_tier_load(src, sq, s_pos, off_in + done +
+                                    (loff_t)n * quantum, quantum, gs.qset);
+                if (!q || IS_ERR(q)) {
+                    retval = q ? PTR_ERR(q) : -ENOMEM;
+                    break;
+                }
+            }
+            if (scull_quantum_real(q)) {
+                if (scull_share_get(q)) {
+                    retval = -ENOMEM;
+                    break;
+                }
+                // 共享的量子计入每个引用它的设备
+                atomic_long_add(quantum, &dst->pool.in_use);
+                set_bit(s_pos, scull_qset_shared(sq, gs.qset));
+            }
+            pin[n++] = q;
+        }
+        if (sq)
+            up(&sq->sem);
+        if (!n)
+            break;
+
+        // 装入dst, 一批量子可能跨越dst的量子集
+        for (i = 0; i < n && !retval; ) {
+            dq = scull_get_qset(dst, off_out + done, 1, &gd);
+            if (IS_ERR(dq) || !dq) {
+                retval = dq ? PTR_ERR(dq) : -ENOMEM;
+                break;
+            }
+            if (gd.quantum != quantum)
+                retval = -EINVAL;   // 两个设备的量子大小必须相同
+            else if (atomic_read(&dst->vmas))
+                retval = -EBUSY;
+            else if (done && gd.gen != *gen)
+                retval = -EAGAIN;   // 期间dst被清空
+            *gen = gd.gen;
+            for (s_pos = gd.rest / quantum; !retval && i < n && s_pos < gd.qset;
+                    s_pos++, i++) {
+                q = dq->data[s_pos];
+                rcu_assign_pointer(dq->data[s_pos], pin[i]);
+                set_bit(s_pos, scull_qset_dirty(dq, gd.qset));
+                if (scull_quantum_real(pin[i]))
+                    set_bit(s_pos, scull_qset_shared(dq, gd.qset));
+                done += quantum;
+                // 读者不解引用压缩的量子, 可以立即释放
+                if (!scull_quantum_real(q)) {
+                    scull_zip_free(dst, q, quantum);
+                    continue;
+                }
+                old[nold++] = q;
+                if (nold == SCULL_PUNCH_BATCH)
+                    scull_free_batch(dst, old, &nold, quantum);
+            }
+            up(&dq->sem);
+        }
+        // 没有装入的引用从未对读者发布, 直接放弃
+        for (; i < n; i++)
+            scull_quantum_release(dst, pin[i], quantum);
+        cond_resched();
+    }
+    scull_free_batch(dst, old, &nold, quantum);
+    kfree(pin);
+    return done ? done : retval;
+}
+
+/**
+ * 把src中[off_in, off_in+len)复制到dst的off_out处, 数据不经过用户空间
+ * 超出src大小的部分不复制, 同一设备中的两个范围不能重叠
+ * SCULL_COPY_REFLINK时两个偏移必须按量子对齐, 两个设备的量子大小必须相同:
+ * 完整的量子以引用计数共享, 写入时才复制(见cow.c), 末尾不足一个量子的
+ * 部分仍然复制. 返回复制的字节数或错误码
+ */
+ssize_t scull_copy_range(struct scull_dev *src, loff_t off_in,
+                        struct scull_dev *dst, loff_t off_out, size_t len,
+                        int flags)
+{
+    unsigned long size, gen = 0;
+    ssize_t done = 0, ret;
+
+    // 日志模式的dst只能追加
+    if (dst->log_mode)
+        return -EBUSY;
+    spin_lock(&src->lock);
+    size = src->size;
+    spin_unlock(&src->lock);
+    if (off_in >= size)
+        return 0;
+    len = min(len, (size_t)(size - off_in));
+    if (src == dst && off_in < off_out + (loff_t)len &&
+            off_out < off_in + (loff_t)len)
+        return -EINVAL;
+
+    if (flags & SCULL_COPY_REFLINK) {
+        done = scull_reflink(src, off_in, dst, off_out, len, &gen);
+        if (done < 0)
+            return done;
+        scull_extend_size(dst, gen, off_out + done);
+        scull_tier_check(dst);
+    }
+    ret = scull_copy_data(src, off_in + done, dst, off_out + done, len - done);
+    if (ret < 0)
+        return done ? done : ret;
+    return done + ret;
+}
+
+
+/**
+ * 从off开始查找下一个数据区(SEEK_DATA)或空洞(SEEK_HOLE)的起点
+ * 以量子为粒度, 整个缺失的量子集一次跳过; 设备末尾视为空洞
+ */
+loff_t scull_seek_data_hole(struct scull_dev *dev, loff_t off, int whence)
+{
+    struct scull_index *idx;
+    struct scull_qset *dptr;
+    unsigned long size;
+    long itemsize, rest;
+    loff_t pos, retval = -ENXIO;
+    int item, s_pos, present;
+
+    rcu_read_lock();
+    size = dev->size;
+    smp_rmb();
+    idx = rcu_dereference(dev->data);
+    if (off < 0 || off >= size)
+        goto out;
+    if (!idx) {
+        if (whence == SEEK_HOLE)
+            retval = off;
+        goto out;
+    }
+    itemsize = (long)idx->quantum * idx->qset;
+
+    // 从off所在量子的起点开始逐个检查
+    scull_split_pos(off, itemsize, &rest);
+    pos = off - rest % idx->quantum;
+    while (pos < size) {
+        item = scull_split_pos(pos, itemsize, &rest);
+        s_pos = rest / idx->quantum;
+        dptr = item < idx->nitems ? rcu_dereference(idx->items[item]) : NULL;
+        if (!dptr) {
+            // 整个量子集都是空洞
+            if (whence == SEEK_HOLE) {
+                retval = max(pos, off);
+                goto out;
+            }
+            pos = (loff_t)(item + 1) * itemsize;
+            continue;
+        }
+        present = rcu_dereference(dptr->data[s_pos]) != NULL;
+        if (present == (whence == SEEK_DATA)) {
+            retval = max(pos, off);
+            goto out;
+        }
+        pos += idx->quantum;
+    }
+    if (whence == SEEK_HOLE)
+        retval = size;
+out:
+    rcu_read_unlock();
+    return retval;
+}
+
+
+/**
+ * 统计设备的内存占用, 元数据和量子分开计算
+ * 每个量子集单独进入一次RCU读临界区, 之间让出CPU, 大设备上也不会拖住
+ * 宽限期; 索引在两次之间被替换时停止. 结果是近似值
+ */
+void scull_mem_usage(struct scull_dev *dev, struct scull_mem *mem)
+{
+    struct scull_index *idx, *start = NULL;
+    struct scull_qset *dptr;
+    int i, j, qset = 0, quantum = 0;
+    void *q;
+
+    memset(mem, 0, sizeof(struct scull_mem));
+    for (i = 0; ; i++) {
+        rcu_read_lock();
+        idx = rcu_dereference(dev->data);
+        if (!i && idx) {
+            start = idx;
+            qset = idx->qset;
+            quantum = idx->quantum;
+            mem->index_bytes = sizeof(struct scull_index) +
+                                idx->nitems * sizeof(struct scull_qset *);
+        }
+        if (!idx || idx != start || i >= idx->nitems) {
+            rcu_read_unlock();
+            break;
+        }
+        dptr = rcu_dereference(idx->items[i]);
+        if (dptr) {
+            mem->nr_qsets++;
+            for (j = 0; j < qset; j++) {
+                q = rcu_dereference(dptr->data[j]);
+                if (q == SCULL_ZERO_QUANTUM) {
+                    mem->nr_zero++;
+                } else if (q == SCULL_SWAPPED_QUANTUM) {
+                    mem->nr_swapped++;
+                } else if (scull_quantum_zipped(q)) {
+                    mem->nr_zipped++;
+                } else if (q) {
+                    mem->nr_quanta++;
+                    if (test_bit(j, scull_qset_shared(dptr, qset)) &&
+                            scull_quantum_shared(q))
+                        mem->nr_shared++;
+                }
+            }
+        }
+        rcu_read_unlock();
+        cond_resched();
+    }
+    if (start) {
+        mem->qset_bytes = mem->nr_qsets * scull_qset_bytes(qset);
+        mem->quantum_bytes = mem->nr_quanta * quantum;
+    }
+    mem->zipped_bytes = atomic_long_read(&dev->zip_bytes);
+}
+
+/**
+ * 把设备中所有的全0标记替换为真正的量子, 换出或压缩的量子调入内存, 与快照
+ * 共享的量子替换为私有的副本, 映射设备前调用. 映射的页被直接写入, 不经过写时复制
+ * 调用者持有dev->sem并且已经增加了dev->vmas, 此后写者不再产生新的标记,
+ * 设备也不能再被快照, 换出或压缩
+ */
+int scull_unshare(struct scull_dev *dev)
+{
+    struct scull_index *idx = dev->data;
+    struct scull_qset *dptr;
+    void *q;
+    int i, j, retval = 0;
+
+    for (i = 0; idx && i < idx->nitems && !retval; i++) {
+        dptr = idx->items[i];
+        if (!dptr)
+            continue;
+        down(&dptr->sem);
+        for (j = 0; j < idx->qset; j++) {
+            q = dptr->data[j];
+            if (scull_quantum_cold(q)) {
+                q = scull_tier_load(dev, dptr, j, (loff_t)i * idx->quantum * idx->qset +
+                                    (loff_t)j * idx->quantum, idx->quantum, idx->qset);
+                if (!q || IS_ERR(q)) {
+                    retval = q ? PTR_ERR(q) : -ENOMEM;
+                    break;
+                }
+                continue;
+            }
+            if (scull_quantum_real(q) && scull_qset_quantum_shared(dptr, idx->qset, j)) {
+                if (!scull_cow(dev, dptr, j, idx->quantum)) {
+                    retval = -ENOMEM;
+                    break;
+                }
+                continue;
+            }
+            if (q != SCULL_ZERO_QUANTUM)
+                continue;
+            q = scull_pool_get_quantum(&dev->pool, idx->quantum);
+            if (!q) {
+                scull_stat_alloc_fail(dev);
+                retval = -ENOMEM;
+                break;
+            }
+            if (!scull_quantum_paged(idx->quantum))
+                memset(q, 0, idx->quantum);
+            rcu_assign_pointer(dptr->data[j], q);
+        }
+        up(&dptr->sem);
+    }
+    return retval;
+}
@@ -0,0 +1,567 @@
+/*
+ * enginebench.c -- 在用户空间测试scull存储引擎的微基准程序
+ *
+ * 用法: enginebench [-q 量子大小] [-Q 量子集大小] [-m MB数] [-b 块大小]
+ *                   [-t 读线程数] [-n 随机操作数] [-z] [-c 驻留上限MB] [-Z] [-T]
+ * 与engine.c, pool.c, cow.c, tier.c, zip.c, shim.c一起编译, 不需要加载内核模块, 可以直接在
+ * perf record/perf stat下运行, 比较数据结构或分配策略改动前后的结果
+ * 依次测试: 顺序写, 顺序读, 多线程随机读, 量子查找, 复制到另一个设备(逐字节
+ * 复制和共享量子两种方式), trim, 日志模式下的多线程追加
+ * 每项输出一行 "名称 ns/op MB/s", 顺序写之后输出元数据和数据的内存占用
+ * -z 时顺序写写入全0的数据, 测试全0量子的去重
+ * -c 时超过上限的量子换出到临时目录中的交换文件, 之后的读取从中调入
+ * -Z 时顺序写之后压缩所有的量子, 之后的顺序读逐个解压
+ * -T 时不测量性能, 只运行正确性测试(见selftest), 失败时以1退出
+ * 编译: make enginebench; make check运行正确性测试
+ */
+
+#include "shim.h"
+#include "scull.h"
+
+#include <unistd.h>
+
+// 存储引擎引用的全局参数, 在内核中由main.c定义
+int scull_quantum = SCULL_QUANTUM;
+int scull_qset = SCULL_QSET;
+struct workqueue_struct *scull_wq;
+
+static struct scull_dev dev;
+static struct scull_dev copy_dev;   // 复制的目标
+static size_t region_mb = 256;
+static size_t blksize = 4096;
+static int nthreads = 1;
+static long nrandom = 1000000;
+static int zeros;
+static size_t cap_mb;
+static int zip;
+
+struct reader {
+    pthread_t tid;
+    unsigned int seed;
+};
+
+static size_t appended;     // 所有追加线程写入的字节数
+
+static void report(const char *name, long ops, size_t bytes, u64 ns)
+{
+    printf("%-12s %10.1f ns/op %10.1f MB/s\n", name, (double)ns / ops,
+            bytes ? bytes / (ns / 1e9) / (1 << 20) : 0.0);
+}
+
+// 顺序读或写整个区域
+static void sequential(int write)
+{
+    size_t total = region_mb << 20;
+    char *buf = malloc(blksize);
+    struct iovec iov = { .iov_base = buf, .iov_len = blksize };
+    loff_t pos = 0;
+    ssize_t ret;
+    long ops = 0;
+    u64 start;
+
+    memset(buf, zeros ? 0 : 'x', blksize);
+    start = scull_now();
+    while (pos < total) {
+        ret = write ? scull_dev_writev(&dev, &iov, 1, &pos)
+                    : scull_dev_readv(&dev, &iov, 1, &pos);
+        if (ret <= 0) {
+            fprintf(stderr, "%s failed: %zd\n", write ? "write" : "read", ret);
+            exit(1);
+        }
+        ops++;
+    }
+    report(write ? "seq-write" : "seq-read", ops, total, scull_now() - start);
+    free(buf);
+}
+
+static void *reader_thread(void *arg)
+{
+    struct reader *r = arg;
+    size_t nblocks = (region_mb << 20) / blksize;
+    char *buf = malloc(blksize);
+    struct iovec iov = { .iov_base = buf, .iov_len = blksize };
+    loff_t pos;
+    long i;
+
+    for (i = 0; i < nrandom / nthreads; i++) {
+        pos = (loff_t)(rand_r(&r->seed) % nblocks) * blksize;
+        scull_dev_readv(&dev, &iov, 1, &pos);
+    }
+    free(buf);
+    return NULL;
+}
+
+// 元数据(索引和量子集节点)与数据(量子)的内存占用
+static void mem_report(void)
+{
+    struct scull_mem mem;
+    unsigned long meta;
+
+    scull_mem_usage(&dev, &mem);
+    meta = mem.index_bytes + mem.qset_bytes;
+    printf("mem          index %lu B, %lu qsets %lu B, %lu quanta %lu B, "
+            "%lu zero, %lu swapped, meta/data %.3f%%\n", mem.index_bytes,
+            mem.nr_qsets, mem.qset_bytes, mem.nr_quanta, mem.quantum_bytes,
+            mem.nr_zero, mem.nr_swapped,
+            mem.quantum_bytes ? meta * 100.0 / mem.quantum_bytes : 0.0);
+}
+
+// 压缩整个区域: 第一遍清除写入时设置的引用位, 第二遍压缩
+static void compress(void)
+{
+    struct scull_mem mem;
+    u64 start;
+    int nr;
+
+    start = scull_now();
+    scull_zip_sweep(&dev);
+    nr = scull_zip_sweep(&dev);
+    report("zip", nr ? nr : 1, region_mb << 20, scull_now() - start);
+    scull_mem_usage(&dev, &mem);
+    printf("zip          %lu quanta %lu B, ratio %.2f\n", mem.nr_zipped,
+            mem.zipped_bytes, mem.zipped_bytes ?
+            (double)mem.nr_zipped * scull_quantum / mem.zipped_bytes : 0.0);
+}
+
+// 多个线程随机读, 与写者和trim分开进行
+static void random_read(void)
+{
+    struct reader *readers = calloc(nthreads, sizeof(*readers));
+    long ops = nrandom / nthreads * nthreads;
+    u64 start;
+    int i;
+
+    start = scull_now();
+    for (i = 0; i < nthreads; i++) {
+        readers[i].seed = i + 1;
+        pthread_create(&readers[i].tid, NULL, reader_thread, &readers[i]);
+    }
+    for (i = 0; i < nthreads; i++)
+        pthread_join(readers[i].tid, NULL);
+    report("rand-read", ops, ops * blksize, scull_now() - start);
+    free(readers);
+}
+
+// 只测量定位量子的代价
+static void lookup(void)
+{
+    unsigned long size = region_mb << 20;
+    unsigned int seed = 1;
+    unsigned long sum = 0;
+    int q_pos;
+    long i;
+    u64 start;
+
+    start = scull_now();
+    for (i = 0; i < nrandom; i++)
+        sum += (unsigned long)scull_lookup(dev.data, rand_r(&seed) % size, &q_pos);
+    report("lookup", nrandom, 0, scull_now() - start);
+    if (!sum)
+        printf("(no quanta found)\n");
+}
+
+// 把整个区域复制到copy_dev, flags为0或SCULL_COPY_REFLINK
+static void copy_one(const char *name, int flags)
+{
+    size_t total = region_mb << 20;
+    ssize_t ret;
+    u64 start;
+
+    start = scull_now();
+    ret = scull_copy_range(&dev, 0, &copy_dev, 0, total, flags);
+    report(name, 1, total, scull_now() - start);
+    if (ret != total || copy_dev.size != total) {
+        fprintf(stderr, "%s: copied %zd, size %lu\n", name, ret, copy_dev.size);
+        exit(1);
+    }
+    down(&copy_dev.sem);
+    scull_trim(&copy_dev);
+    up(&copy_dev.sem);
+    rcu_barrier();
+}
+
+static void copy(void)
+{
+    copy_one("copy", 0);
+    copy_one("reflink", SCULL_COPY_REFLINK);
+}
+
+// trim本身只摘下索引, 释放在rcu_barrier中完成
+static void trim(void)
+{
+    u64 start, mid;
+
+    start = scull_now();
+    down(&dev.sem);
+    scull_trim(&dev);
+    up(&dev.sem);
+    mid = scull_now();
+    rcu_barrier();
+    report("trim", 1, 0, mid - start);
+    report("trim-free", 1, region_mb << 20, scull_now() - mid);
+}
+
+static void *append_thread(void *arg)
+{
+    size_t total = (region_mb << 20) / nthreads, done = 0;
+    char *buf = malloc(blksize);
+    struct iovec iov = { .iov_base = buf, .iov_len = blksize };
+    loff_t pos;
+    ssize_t ret;
+
+    memset(buf, 'a', blksize);
+    while (done + blksize <= total) {
+        ret = scull_dev_append(&dev, &iov, 1, &pos);
+        if (ret != blksize) {
+            fprintf(stderr, "append failed: %zd\n", ret);
+            exit(1);
+        }
+        done += ret;
+    }
+    __sync_fetch_and_add(&appended, done);
+    free(buf);
+    return NULL;
+}
+
+// 日志模式下多个线程并发追加, 结束时水位应等于写入的总量
+static void append(void)
+{
+    pthread_t *tids = calloc(nthreads, sizeof(*tids));
+    u64 start;
+    int i;
+
+    scull_set_log(&dev, 1);
+    start = scull_now();
+    for (i = 0; i < nthreads; i++)
+        pthread_create(&tids[i], NULL, append_thread, NULL);
+    for (i = 0; i < nthreads; i++)
+        pthread_join(tids[i], NULL);
+    report("append", appended / blksize, appended, scull_now() - start);
+    if (dev.size != appended || dev.log_pending) {
+        fprintf(stderr, "append: size %lu, appended %zu\n", dev.size, appended);
+        exit(1);
+    }
+    scull_set_log(&dev, 0);
+    free(tids);
+}
+
+/**
+ * 正确性测试: 在dev和copy_dev上写入已知的模式, 同时维护两份期望的内容,
+ * 每一步之后读出整个设备与之比较. 依次覆盖跨量子的读写和全0量子, 打洞和
+ * 预分配, 快照和复制(包括共享量子)之后两边的写时复制, 换出和压缩的量子的
+ * 读写, 日志模式的追加; 最后清空设备, 检查所有量子的字节数都已归还
+ */
+static unsigned long test_size;     // 测试设备的大小, 量子的整数倍
+static char *test_model[2];         // dev和copy_dev的期望内容
+static unsigned int test_seed = 1;
+static int test_gen;                // 每次写入的模式不同, 覆盖写可以被发现
+
+#define test_dev(i)	((i) ? &copy_dev : &dev)
+
+static void test_fail(const char *name, const char *what, long long off)
+{
+    fprintf(stderr, "%s: %s (offset %lld)\n", name, what, off);
+    exit(1);
+}
+
+// 在设备i的off处写入len字节, zero时写入全0, 同时更新期望的内容
+static void test_write(const char *name, int i, loff_t off, size_t len, int zero)
+{
+    char *buf = test_model[i] + off;
+    struct iovec iov;
+    loff_t pos = off;
+    ssize_t ret;
+    size_t k;
+
+    test_gen++;
+    for (k = 0; k < len; k++)
+        buf[k] = zero ? 0 : (char)((off + k) * 7 + (off + k) / 4093 + test_gen);
+    while (len) {
+        iov.iov_base = test_model[i] + pos;
+        iov.iov_len = len;
+        ret = scull_dev_writev(test_dev(i), &iov, 1, &pos);
+        if (ret <= 0)
+            test_fail(name, "write failed", pos);
+        len -= ret;
+    }
+}
+
+// 日志模式下在设备i末尾追加len字节, 同时更新期望的内容
+static void test_append(const char *name, int i, size_t len)
+{
+    struct scull_dev *d = test_dev(i);
+    unsigned long off = d->size;
+    struct iovec iov;
+    loff_t pos;
+    size_t k;
+
+    test_gen++;
+    for (k = 0; k < len; k++)
+        test_model[i][off + k] = (char)((off + k) * 5 + test_gen);
+    iov.iov_base = test_model[i] + off;
+    iov.iov_len = len;
+    if (scull_dev_append(d, &iov, 1, &pos) != len || pos != off + len)
+        test_fail(name, "append failed", off);
+}
+
+// 随机位置, 随机长度(可能跨越量子和量子集)的n次写入
+static void test_scribble(const char *name, int i, int n)
+{
+    size_t len;
+    loff_t off;
+
+    while (n--) {
+        off = rand_r(&test_seed) % test_size;
+        len = rand_r(&test_seed) % (2 * scull_quantum) + 1;
+        if (off + len > test_size)
+            len = test_size - off;
+        test_write(name, i, off, len, 0);
+    }
+}
+
+// 读出整个设备i, 与期望的内容比较
+static void test_verify(const char *name, int i)
+{
+    struct scull_dev *d = test_dev(i);
+    char *buf = malloc(test_size);
+    struct iovec iov;
+    loff_t pos = 0;
+    ssize_t ret;
+    size_t k;
+
+    if (d->size != test_size)
+        test_fail(name, "wrong size", d->size);
+    while (pos < test_size) {
+        iov.iov_base = buf + pos;
+        iov.iov_len = test_size - pos;
+        ret = scull_dev_readv(d, &iov, 1, &pos);
+        if (ret <= 0)
+            test_fail(name, "read failed", pos);
+    }
+    for (k = 0; k < test_size; k++)
+        if (buf[k] != test_model[i][k])
+            test_fail(name, i ? "copy_dev differs" : "dev differs", k);
+    free(buf);
+}
+
+static void test_trim(int i)
+{
+    down(&test_dev(i)->sem);
+    scull_trim(test_dev(i));
+    up(&test_dev(i)->sem);
+    memset(test_model[i], 0, test_size);
+}
+
+static void test_ok(const char *name, int both)
+{
+    test_verify(name, 0);
+    if (both)
+        test_verify(name, 1);
+    printf("%-12s ok\n", name);
+}
+
+static void selftest(void)
+{
+    char swapname[64];
+    struct scull_mem mem;
+    loff_t off;
+    int i, nq;
+
+    test_size = (unsigned long)scull_quantum * scull_qset * 3;
+    if (test_size > (32 << 20))
+        test_size = (32 << 20) / scull_quantum * scull_quantum;
+    nq = test_size / scull_quantum;
+    for (i = 0; i < 2; i++)
+        test_model[i] = calloc(test_size, 1);
+
+    // 跨量子的读写, 整个量子的全0写入以标记代替
+    test_write("rw", 0, 0, test_size, 0);
+    test_scribble("rw", 0, 200);
+    for (i = 0; i < 8; i++)
+        test_write("rw", 0, (loff_t)(rand_r(&test_seed) % nq) * scull_quantum,
+                    scull_quantum, 1);
+    test_scribble("rw", 0, 20);
+    test_ok("rw", 0);
+
+    // 不对齐的打洞只清零两端的部分量子; 空洞读出0, 预分配清零已有的数据
+    off = scull_quantum / 2;
+    if (scull_punch_hole(&dev, off, 3 * scull_quantum))
+        test_fail("hole", "punch failed", off);
+    memset(test_model[0] + off, 0, 3 * scull_quantum);
+    if (scull_seek_data_hole(&dev, off, SEEK_HOLE) != scull_quantum)
+        test_fail("hole", "SEEK_HOLE missed the hole", off);
+    off = (loff_t)(nq - 2) * scull_quantum + 1;
+    if (scull_prealloc(&dev, off, scull_quantum, SCULL_FALLOC_ZERO))
+        test_fail("hole", "prealloc failed", off);
+    memset(test_model[0] + off, 0, scull_quantum);
+    test_ok("hole", 0);
+
+    // 快照之后两边各自写入, 互不影响
+    if (scull_snapshot(&dev, &copy_dev))
+        test_fail("snapshot", "snapshot failed", 0);
+    memcpy(test_model[1], test_model[0], test_size);
+    test_ok("snapshot", 1);
+    test_scribble("snapshot", 0, 50);
+    test_scribble("snapshot", 1, 50);
+    test_ok("snap-cow", 1);
+
+    // 逐字节复制任意范围, 共享量子复制对齐的范围, 之后两边各自写入
+    test_trim(1);
+    if (scull_copy_range(&dev, 123, &copy_dev, 0, test_size - 123, 0) !=
+            test_size - 123)
+        test_fail("copy", "copy failed", 123);
+    memcpy(test_model[1], test_model[0] + 123, test_size - 123);
+    off = test_size - 123;
+    if (scull_copy_range(&dev, 0, &copy_dev, off, 123, 0) != 123)
+        test_fail("copy", "copy failed", off);
+    memcpy(test_model[1] + off, test_model[0], 123);
+    off = (loff_t)(nq / 2) * scull_quantum;
+    if (scull_copy_range(&dev, 0, &copy_dev, off, off, SCULL_COPY_REFLINK) != off)
+        test_fail("reflink", "reflink failed", off);
+    memcpy(test_model[1] + off, test_model[0], off);
+    test_ok("copy", 1);
+    test_scribble("reflink-cow", 0, 50);
+    test_scribble("reflink-cow", 1, 50);
+    test_ok("reflink-cow", 1);
+
+    // 换出: 不再共享量子后, 驻留上限为设备大小的1/4
+    test_trim(1);
+    scull_swap = "/tmp/enginebench-swap.";
+    if (scull_tier_setup(&dev, getpid())) {
+        fprintf(stderr, "swap: cannot create swap file\n");
+        exit(1);
+    }
+    // 文件保持打开, 退出时自动删除
+    snprintf(swapname, sizeof(swapname), "%s%i", scull_swap, getpid());
+    unlink(swapname);
+    test_write("swap", 0, 0, test_size, 0);
+    rcu_barrier();      // 用户空间中被替换的量子到此才释放, 否则仍计入驻留量
+    scull_set_mem_cap(&dev, test_size / 4);
+    scull_mem_usage(&dev, &mem);
+    if (!mem.nr_swapped)
+        test_fail("swap", "nothing swapped", 0);
+    test_ok("swap", 0);
+    test_scribble("swap", 0, 100);
+    test_ok("swap-write", 0);
+
+    // 压缩: 第一遍清除引用位, 第二遍压缩; 换出的量子调入后也可以被压缩
+    scull_set_mem_cap(&dev, 0);
+    if (scull_set_zip(&dev, 1))
+        test_fail("zip", "cannot enable compression", 0);
+    test_verify("zip", 0);
+    scull_zip_sweep(&dev);
+    scull_zip_sweep(&dev);
+    scull_mem_usage(&dev, &mem);
+    if (!mem.nr_zipped)
+        test_fail("zip", "nothing compressed", 0);
+    test_ok("zip", 0);
+    scull_zip_sweep(&dev);
+    scull_zip_sweep(&dev);
+    test_scribble("zip-write", 0, 100);
+    test_ok("zip-write", 0);
+    scull_zip_sweep(&dev);
+    scull_zip_sweep(&dev);
+    if (scull_snapshot(&dev, &copy_dev))
+        test_fail("zip-snap", "snapshot failed", 0);
+    memcpy(test_model[1], test_model[0], test_size);
+    test_ok("zip-snap", 1);
+
+    // 日志模式: 关闭后可以普通写入, 再次打开时从当前大小继续追加
+    test_trim(1);
+    scull_set_log(&copy_dev, 1);
+    test_append("log", 1, test_size / 2);
+    if (scull_set_log(&copy_dev, 0))
+        test_fail("log", "cannot leave log mode", copy_dev.size);
+    test_write("log", 1, 0, scull_quantum, 0);
+    scull_set_log(&copy_dev, 1);
+    test_append("log", 1, test_size - test_size / 2);
+    if (copy_dev.log_pending)
+        test_fail("log", "ranges left uncommitted", copy_dev.size);
+    scull_set_log(&copy_dev, 0);
+    test_ok("log", 1);
+
+    // 清空后量子全部归还, 压缩的数据全部释放
+    test_trim(0);
+    test_trim(1);
+    rcu_barrier();
+    if (atomic_long_read(&dev.pool.in_use) || atomic_long_read(&copy_dev.pool.in_use))
+        test_fail("leak", "quanta still accounted", atomic_long_read(&dev.pool.in_use));
+    if (atomic_long_read(&dev.zip_bytes))
+        test_fail("leak", "compressed bytes still accounted",
+                    atomic_long_read(&dev.zip_bytes));
+    printf("%-12s ok\n", "leak");
+    for (i = 0; i < 2; i++)
+        free(test_model[i]);
+}
+
+int main(int argc, char **argv)
+{
+    char swapname[64];
+    int opt, test = 0;
+
+    while ((opt = getopt(argc, argv, "q:Q:m:b:t:n:zc:ZT")) != -1) {
+        switch (opt) {
+        case 'q': scull_quantum = atoi(optarg); break;
+        case 'Q': scull_qset = atoi(optarg); break;
+        case 'm': region_mb = strtoul(optarg, NULL, 0); break;
+        case 'b': blksize = strtoul(optarg, NULL, 0); break;
+        case 't': nthreads = atoi(optarg); break;
+        case 'n': nrandom = atol(optarg); break;
+        case 'z': zeros = 1; break;
+        case 'c': cap_mb = strtoul(optarg, NULL, 0); break;
+        case 'Z': zip = 1; break;
+        case 'T': test = 1; break;
+        default:
+            fprintf(stderr, "usage: %s [-q quantum] [-Q qset] [-m mb] "
+                    "[-b blksize] [-t threads] [-n random_ops] [-z] [-c cap_mb] [-Z] [-T]\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+    if (!blksize || (region_mb << 20) < blksize || nthreads < 1 ||
+            nrandom < nthreads || scull_quantum < SCULL_QUANTUM_MIN ||
+            scull_qset < 1) {
+        fprintf(stderr, "bad parameters\n");
+        return 1;
+    }
+
+    scull_dev_init(&dev);
+    scull_dev_init(&copy_dev);
+    if (test) {
+        printf("# quantum %d qset %d\n", scull_quantum, scull_qset);
+        selftest();
+        scull_dev_cleanup(&dev);
+        scull_dev_cleanup(&copy_dev);
+        return 0;
+    }
+    if (cap_mb) {
+        scull_swap = "/tmp/enginebench-swap.";
+        scull_mem_cap = cap_mb << 10;
+        if (scull_tier_setup(&dev, getpid())) {
+            fprintf(stderr, "cannot create swap file\n");
+            return 1;
+        }
+        // 文件保持打开, 退出时自动删除
+        snprintf(swapname, sizeof(swapname), "%s%i", scull_swap, getpid());
+        unlink(swapname);
+    }
+    if (zip && scull_set_zip(&dev, 1)) {
+        fprintf(stderr, "cannot enable compression\n");
+        return 1;
+    }
+    printf("# quantum %d qset %d region %zu MB block %zu threads %d\n",
+            scull_quantum, scull_qset, region_mb, blksize, nthreads);
+    sequential(1);
+    mem_report();
+    if (zip)
+        compress();
+    sequential(0);
+    random_read();
+    lookup();
+    copy();
+    trim();
+    append();
+    scull_dev_cleanup(&dev);
+    scull_dev_cleanup(&copy_dev);
+    return 0;
+}
@@ -23,6 +23,13 @@
 #include <linux/seq_file.h>
 #include <linux/sched.h>
 #include <linux/capability.h>
+#include <linux/rcupdate.h>
+#include <linux/pagemap.h>	// fault_in_pages_writeable()
+#include <linux/uio.h>		// struct iovec, iov_length()
+#include <linux/highmem.h>	// kmap()
+#include <linux/workqueue.h>	// flush_scheduled_work()
+#include <linux/poll.h>
+#include <linux/file.h>		// fget()
 
 
 #include "scull.h"
@@ -44,31 +51,8 @@ MODULE_AUTHOR("Bangduo Chen");
 MODULE_LICENSE("GPL");
 
 struct scull_dev *scull_devices;    //在scull_init_module中申请
-
-// 清理struct scull_dev结构
-int scull_trim(struct scull_dev *dev)
-{
-    struct scull_qset *next, *dptr;
-    int qset = dev->qset;
-    int i;
-
-    // 所有项目
-    for (dptr = dev->data; dptr; dptr = next) {
-        if (dptr->data) {
-            for (i=0; i < qset; i++)
-                kfree(dptr->data[i]);
-            kfree(dptr->data);
-            dptr->data = NULL;
-        }
-        next = dptr->next;
-        kfree(dptr);
-    }
-    dev->size = 0;
-    dev->quantum = scull_quantum;
-    dev->qset = scull_qset;
-    dev->data = NULL;
-    return 0;
-}
+static int scull_nr_ready;          // 已经初始化的scull设备数
+struct workqueue_struct *scull_wq;  // 后台释放数据使用的工作队列
 
 #ifdef SCULL_DEBUG // 打开调试以启用/proc文件
 
@@ -76,25 +60,36 @@ int scull_trim(struct scull_dev *dev)
 int scull_read_procmem(char *buf, char **start, off_t offset, int count,
                         int *eof, void *data)
 {
-    int i, j, len = 0;
+    int i, j, k, len = 0;
     int limit = count - 80; // 不要获取超过这个值的数据
 
     for (i=0; i<scull_nr_devs && len <= limit; i++) {
         struct scull_dev *d = &scull_devices[i];
-        struct scull_qset *qs = d->data;
+        struct scull_index *idx;
+        struct scull_qset *qs, *last = NULL;
         if (down_interruptible(&d->sem))
             return -ERESTARTSYS;
         len += sprintf(buf + len, "\nDevice %i: qset %i, q %i, sz %li\n",
                         i, d->qset, d->quantum, d->size);
-        for (; qs && len <= limit; qs = qs->next) { // 扫描列表
-            len += sprintf(buf + len, " item at %p, qset at %p\n",
-                            qs, qs->data);
-            if (qs->data && !qs->next) {
-                //只打印最后一个项目
-                for (j=0; j < d->qset; j++) {
-                    if(qs->data[j]) {
-                        len += sprintf(buf + len, " %4i: %8p\n", j, qs->data[j]);
-                    }
+        len += sprintf(buf + len, " pool: quanta %i, hits %lu, misses %lu\n",
+                        d->pool.nr_quanta, d->pool.hits, d->pool.misses);
+        if (scull_quantum_paged(d->quantum) && get_order(d->quantum))
+            len += sprintf(buf + len, " quanta: order %i x %i, order 0 (vmalloc) x %i\n",
+                            get_order(d->quantum), atomic_read(&d->pool.nr_high),
+                            atomic_read(&d->pool.nr_fallback));
+        idx = d->data;
+        for (k = 0; idx && k < idx->nitems && len <= limit; k++) { // 扫描索引数组
+            qs = idx->items[k];
+            if (!qs)
+                continue;
+            len += sprintf(buf + len, " item %i at %p\n", k, qs);
+            last = qs;
+        }
+        if (last) {
+            //只打印最后一个项目
+            for (j=0; j < d->qset && len <= limit; j++) {
+                if(last->data[j]) {
+                    len += sprintf(buf + len, " %4i: %8p\n", j, last->data[j]);
                 }
             }
         }
@@ -129,7 +124,8 @@ static void scull_seq_stop(struct seq_file *sfile, void *v)
 static int scull_seq_show(struct seq_file *s, void *v)
 {
     struct scull_dev *dev = (struct scull_dev *) v;
-    struct scull_qset *d;
+    struct scull_index *idx;
+    struct scull_qset *d, *last = NULL;
     int i;
 
     if (down_interruptible(&dev->sem))
@@ -137,16 +133,29 @@ static int scull_seq_show(struct seq_file *s, void *v)
     seq_printf(s, "\nDevice %i: qset %i, q %i, sz %li\n",
                 (int)(dev - scull_devices), dev->qset, 
                 dev->quantum, dev->size);
-    for (d = dev->data; d; d = d->next) {
-        // 遍历链表
-        seq_printf(s, " item at %p, qset at %p\n",d, d->data);
-        // 输出最后一项
-        if (d->data && !d->next)
-            for (i = 0; i < dev->qset; i++){
-                if (d->data[i])
-                    seq_printf(s, " %4i: %8p\n", i, d->data[i]);
-            }
+    seq_printf(s, " pool: quanta %i, hits %lu, misses %lu, "
+                "refills %lu, frees %lu\n", dev->pool.nr_quanta,
+                dev->pool.hits, dev->pool.misses,
+                dev->pool.refills, dev->pool.frees);
+    if (scull_quantum_paged(dev->quantum) && get_order(dev->quantum))
+        seq_printf(s, " quanta: order %i x %i, order 0 (vmalloc) x %i\n",
+                    get_order(dev->quantum), atomic_read(&dev->pool.nr_high),
+                    atomic_read(&dev->pool.nr_fallback));
+    idx = dev->data;
+    for (i = 0; idx && i < idx->nitems; i++) {
+        // 遍历索引数组
+        d = idx->items[i];
+        if (!d)
+            continue;
+        seq_printf(s, " item %i at %p\n", i, d);
+        last = d;
     }
+    // 输出最后一项
+    if (last)
+        for (i = 0; i < dev->qset; i++){
+            if (last->data[i])
+                seq_printf(s, " %4i: %8p\n", i, last->data[i]);
+        }
     up(&dev->sem);
     return 0;
 }
@@ -204,12 +213,18 @@ int scull_open(struct inode *inode, struct file *filp)
     dev = container_of(inode->i_cdev, struct scull_dev, cdev);
     filp->private_data = dev;
 
-    // 如果以只写打开则将设备的长度设置为0
-    if ((filp->f_flags & O_ACCMODE) == O_WRONLY) {
+    // 如果以只写打开则将设备的长度设置为0, 追加写入的不清空
+    if ((filp->f_flags & O_ACCMODE) == O_WRONLY && !(filp->f_flags & O_APPEND)) {
+        u64 start = scull_now();
+        int retval;
+
         if (down_interruptible(&dev->sem))
             return -ERESTARTSYS;
-        scull_trim(dev);
+        scull_stat_sem_wait(dev, start);
+        retval = scull_trim(dev);
         up(&dev->sem);
+        if (retval)
+            return retval;
     }
     return 0;   // 打开成功
 }
@@ -219,131 +234,347 @@ int scull_release(struct inode *inode, struct file *filp)
     return 0;
 }
 
-// 到达指定位置
-struct scull_qset *scull_follow(struct scull_dev *dev, int n)
+/**
+ * 分散读取, 由存储引擎完成, 读者不获取dev->sem
+ * 设备大小以内的空洞读出0
+ */
+ssize_t scull_readv(struct file *filp, const struct iovec *iov,
+                    unsigned long nr_segs, loff_t *f_pos)
 {
-    struct scull_qset *qs = dev->data;
-
-    // 如果需要则申请一块内存
-    if (!qs) {
-        qs = dev->data = kmalloc(sizeof(struct scull_qset), GFP_KERNEL);
-        if (qs == NULL)
-            return NULL;
-        memset(qs, 0, sizeof(struct scull_qset));
-    }
-    
-    // 到达指定位置
-    while (n--) {
-        if(!qs->next) {
-            qs->next = kmalloc(sizeof(struct scull_qset), GFP_KERNEL);
-            if (qs->next == NULL)
-                return NULL;
-            memset(qs->next, 0, sizeof(struct scull_qset));
-        }
-        qs = qs->next;
-    }
-    return qs;
+    return scull_dev_readv(filp->private_data, iov, nr_segs, f_pos);
 }
 
-// 读取数据
 ssize_t scull_read(struct file *filp, char __user *buf, size_t count,
                     loff_t *f_pos)
 {
-    PDEBUG("read some data\n");
-    struct scull_dev *dev = filp->private_data;
-    struct scull_qset *dptr;    // 量子集列表的第一项
-    int quantum = dev->quantum, qset = dev->qset;   // 总的数据量
-    int itemsize = quantum * qset;
-    int item, s_pos, q_pos, rest;
-    ssize_t retval = 0;
+    struct iovec iov = { .iov_base = buf, .iov_len = count };
 
-    if (down_interruptible(&dev->sem))
-        return -ERESTARTSYS;
-    if (*f_pos + count >= dev->size)
-        count = dev->size - *f_pos;
+    return scull_readv(filp, &iov, 1, f_pos);
+}
 
-    // 在量子集中寻找链表项, qset索引以及偏移量
-    item = (long)*f_pos / itemsize;
-    rest = (long)*f_pos % itemsize;
-    s_pos = rest / quantum;
-    q_pos = rest % quantum;
+/**
+ * 集中写入, 按需申请缺失的量子集和量子
+ * 日志模式下只接受追加, 由scull_dev_append预留位置; 普通模式下的
+ * O_APPEND写入从当前大小开始(与其他写者并发时不保证不重叠)
+ */
+ssize_t scull_writev(struct file *filp, const struct iovec *iov,
+                    unsigned long nr_segs, loff_t *f_pos)
+{
+    struct scull_dev *dev = filp->private_data;
+
+    if (dev->log_mode) {
+        if (!(filp->f_flags & O_APPEND))
+            return -EPERM;
+        return scull_dev_append(dev, iov, nr_segs, f_pos);
+    }
+    if (filp->f_flags & O_APPEND)
+        *f_pos = dev->size;
+    return scull_dev_writev(dev, iov, nr_segs, f_pos);
+}
 
-    // 到达指定的位置
-    dptr = scull_follow(dev, item);
+ssize_t scull_write(struct file *filp, const char __user *buf, size_t count,
+                    loff_t *f_pos)
+{
+    struct iovec iov = { .iov_base = (void __user *)buf, .iov_len = count };
 
-    if (dptr == NULL || !dptr->data || !dptr->data[s_pos])
-        goto out;
+    return scull_writev(filp, &iov, 1, f_pos);
+}
 
-    // 只读到量子末尾
-    if (count > quantum - q_pos)
-        count = quantum - q_pos;
+/**
+ * sendfile: 把设备内容交给actor(通常是发送到套接字), 不经过用户空间
+ * 页对齐的量子直接以页的引用交出; 其他量子所在的slab页可能在trim后被
+ * 重新使用, 因此先在RCU保护下复制到一个私有的中转页
+ * actor可能睡眠, 调用actor时不处于RCU读临界区
+ */
+ssize_t scull_sendfile(struct file *filp, loff_t *ppos, size_t count,
+                        read_actor_t actor, void *target)
+{
+    struct scull_dev *dev = filp->private_data;
+    struct scull_index *idx;
+    struct page *page, *bounce = NULL;
+    read_descriptor_t desc;
+    unsigned long size, offset, len, ret;
+    loff_t pos = *ppos;
+    char *q;
+    int q_pos;
+
+    desc.written = 0;
+    desc.count = count;
+    desc.arg.data = target;
+    desc.error = 0;
+
+    while (desc.count) {
+        rcu_read_lock();
+        size = dev->size;
+        smp_rmb();
+        idx = rcu_dereference(dev->data);
+        if (!idx || pos >= size) {
+            rcu_read_unlock();
+            break;
+        }
+        q = scull_lookup(idx, pos, &q_pos);
+        if (scull_quantum_cold(q)) {
+            rcu_read_unlock();
+            desc.error = scull_tier_fault(dev, pos);
+            if (desc.error)
+                break;
+            continue;   // 调入后重新查找
+        }
+        // 每次最多交出一页, 不能跨越量子或设备末尾
+        len = min(desc.count, (size_t)(idx->quantum - q_pos));
+        len = min(len, size - (unsigned long)pos);
+        if (!q) {
+            // 空洞: 交出零页
+            page = ZERO_PAGE(0);
+            offset = 0;
+            len = min(len, PAGE_SIZE);
+            get_page(page);
+        } else if (scull_quantum_paged(idx->quantum)) {
+            page = scull_quantum_page(q + q_pos);
+            offset = offset_in_page(q + q_pos);
+            len = min(len, PAGE_SIZE - offset);
+            get_page(page);     // 复合页的引用计在首页上, trim后页面仍然有效
+        } else {
+            if (!bounce) {
+                rcu_read_unlock();
+                bounce = alloc_page(GFP_KERNEL);
+                if (!bounce) {
+                    desc.error = -ENOMEM;
+                    break;
+                }
+                continue;   // 重新查找
+            }
+            len = min(len, PAGE_SIZE);
+            memcpy(page_address(bounce), q + q_pos, len);
+            page = bounce;
+            offset = 0;
+            get_page(page);
+        }
+        rcu_read_unlock();
 
-    if (copy_to_user(buf, dptr->data[s_pos] + q_pos, count)) {
-        retval = -EFAULT;
-        goto out;
+        ret = actor(&desc, page, offset, len);
+        put_page(page);
+        if (page == bounce && page_count(bounce) > 1) {
+            __free_page(bounce);    // actor仍引用中转页, 下次另外申请
+            bounce = NULL;
+        }
+        pos += ret;
+        if (ret != len || desc.error)   // 目标已满或出错
+            break;
     }
-    *f_pos += count;
-    retval = count;
-out:
-    up(&dev->sem);
+    if (bounce)
+        __free_page(bounce);
+
+    *ppos = pos;
+    if (desc.written)
+        return desc.written;
+    return desc.error;
+}
+
+/**
+ * sendpage: 作为sendfile的目标, 把页中的数据写入设备
+ * 页已经在内核空间, 临时切换地址空间限制后复用scull_write的复制循环
+ */
+ssize_t scull_sendpage(struct file *filp, struct page *page, int offset,
+                        size_t size, loff_t *ppos, int more)
+{
+    mm_segment_t old_fs;
+    ssize_t retval;
+    char *kaddr;
+
+    kaddr = kmap(page);
+    old_fs = get_fs();
+    set_fs(KERNEL_DS);
+    retval = scull_write(filp, (const char __user *)(kaddr + offset), size, ppos);
+    set_fs(old_fs);
+    kunmap(page);
     return retval;
 }
 
-ssize_t scull_write(struct file *filp, const char __user *buf, size_t count,
-                    loff_t *f_pos)
+/**
+ * 普通模式下总是可读写; 日志模式下文件位置之后有已提交的记录时可读,
+ * 读者因此可以用poll等待新的记录
+ */
+static unsigned int scull_poll(struct file *filp, poll_table *wait)
 {
-    PDEBUG("write some data\n");
     struct scull_dev *dev = filp->private_data;
-    struct scull_qset *dptr;    // 量子集列表的第一项
-    int quantum = dev->quantum, qset = dev->qset;   // 总的数据量
-    int itemsize = quantum * qset;
-    int item, s_pos, q_pos, rest;
-    ssize_t retval = -ENOMEM; // 用于goto out 语句后的返回值
-
-    if (down_interruptible(&dev->sem))
-        return -ERESTARTSYS;
- 
+    unsigned int mask = POLLOUT | POLLWRNORM;
+
+    if (!dev->log_mode)
+        return mask | POLLIN | POLLRDNORM;
+    poll_wait(filp, &dev->log_wait, wait);
+    spin_lock(&dev->lock);
+    if (filp->f_pos < dev->size)
+        mask |= POLLIN | POLLRDNORM;
+    spin_unlock(&dev->lock);
+    return mask;
+}
 
-    // 在量子集中寻找链表项, qset索引以及偏移量
-    item = (long)*f_pos / itemsize;
-    rest = (long)*f_pos % itemsize;
-    s_pos = rest / quantum;
-    q_pos = rest % quantum;
-    
-    // 到达指定位置
-    dptr = scull_follow(dev, item);
-    if (dptr == NULL)
-        goto out;
-    if(!dptr->data) {
-        dptr->data = kmalloc(qset * sizeof(char *), GFP_KERNEL);
-        if (!dptr->data)
-            goto out;
-        memset(dptr->data, 0, qset * sizeof(char *));
-    }
-    if (!dptr->data[s_pos]) {
-        dptr->data[s_pos] = kmalloc(quantum, GFP_KERNEL);
-        if (!dptr->data[s_pos])
-            goto out;
+// 处理SCULL_IOCFALLOC
+static int scull_ioctl_falloc(struct file *filp, struct scull_falloc __user *arg)
+{
+    struct scull_dev *dev = filp->private_data;
+    struct scull_falloc fa;
+
+    // scull_ioctl也被pipe设备使用, 其private_data不是scull_dev
+    if (filp->f_op == &scull_pipe_fops)
+        return -ENOTTY;
+    if (!(filp->f_mode & FMODE_WRITE))
+        return -EBADF;
+    if (copy_from_user(&fa, arg, sizeof(fa)))
+        return -EFAULT;
+    if (fa.offset < 0 || fa.len <= 0 || fa.offset + fa.len < fa.offset)
+        return -EINVAL;
+    if (fa.mode & ~(SCULL_FALLOC_KEEP_SIZE | SCULL_FALLOC_PUNCH_HOLE |
+                    SCULL_FALLOC_ZERO))
+        return -EINVAL;
+
+    if (fa.mode & SCULL_FALLOC_PUNCH_HOLE) {
+        if (fa.mode & SCULL_FALLOC_ZERO)
+            return -EINVAL;
+        return scull_punch_hole(dev, fa.offset, fa.len);
     }
+    return scull_prealloc(dev, fa.offset, fa.len, fa.mode);
+}
+
+// 处理SCULL_IOCSGEOM和SCULL_IOCGGEOM
+static int scull_ioctl_geom(struct file *filp, unsigned int cmd,
+                            struct scull_geometry __user *arg)
+{
+    struct scull_dev *dev = filp->private_data;
+    struct scull_geometry geo;
 
-    // 只写到量子的末尾
-    if (count > quantum - q_pos)
-        count = quantum - q_pos;
+    if (filp->f_op == &scull_pipe_fops)
+        return -ENOTTY;
 
-    if (copy_from_user(dptr->data[s_pos] + q_pos, buf, count)) {
-        retval = -EFAULT;
-        goto out;
+    if (cmd == SCULL_IOCGGEOM) {
+        scull_get_geometry(dev, &geo);
+        return copy_to_user(arg, &geo, sizeof(geo)) ? -EFAULT : 0;
     }
-    *f_pos += count;
-    retval = count;
 
-    // 更新大小
-    if (dev->size < *f_pos)
-        dev->size = *f_pos;
+    if (!(filp->f_mode & FMODE_WRITE))
+        return -EBADF;
+    if (copy_from_user(&geo, arg, sizeof(geo)))
+        return -EFAULT;
+    return scull_set_geometry(dev, &geo);
+}
 
-out:
-    up(&dev->sem);
-    return retval;
+// 处理SCULL_IOCSNAP, minor为目标设备的次设备号
+static int scull_ioctl_snap(struct file *filp, unsigned long minor)
+{
+    struct scull_dev *dev = filp->private_data;
+    int i = (int)minor - scull_minor;
+
+    if (filp->f_op == &scull_pipe_fops)
+        return -ENOTTY;
+    if (minor > INT_MAX || i < 0 || i >= scull_nr_devs)
+        return -ENODEV;
+    // 快照会清空目标设备
+    if (!capable(CAP_SYS_ADMIN))
+        return -EPERM;
+    return scull_snapshot(dev, scull_devices + i);
+}
+
+// 处理SCULL_IOCCKPT
+static int scull_ioctl_ckpt(struct file *filp, unsigned long mode)
+{
+    if (filp->f_op == &scull_pipe_fops)
+        return -ENOTTY;
+    if (mode != SCULL_CKPT_FULL && mode != SCULL_CKPT_INCREMENTAL)
+        return -EINVAL;
+    // 以内核的权限写文件
+    if (!capable(CAP_SYS_ADMIN))
+        return -EPERM;
+    return scull_checkpoint(filp->private_data, mode);
+}
+
+// 处理SCULL_IOCLOG
+static int scull_ioctl_log(struct file *filp, unsigned long on)
+{
+    if (filp->f_op == &scull_pipe_fops)
+        return -ENOTTY;
+    if (!(filp->f_mode & FMODE_WRITE))
+        return -EBADF;
+    return scull_set_log(filp->private_data, on != 0);
+}
+
+// 处理SCULL_IOCMEMCAP, kb为上限的KB数
+static int scull_ioctl_memcap(struct file *filp, unsigned long kb)
+{
+    if (filp->f_op == &scull_pipe_fops)
+        return -ENOTTY;
+    if (!(filp->f_mode & FMODE_WRITE))
+        return -EBADF;
+    if (kb > ULONG_MAX >> 10)
+        return -EINVAL;
+    return scull_set_mem_cap(filp->private_data, kb << 10);
+}
+
+// 处理SCULL_IOCZIP, idle为压缩周期的秒数
+static int scull_ioctl_zip(struct file *filp, unsigned long idle)
+{
+    if (filp->f_op == &scull_pipe_fops)
+        return -ENOTTY;
+    if (!(filp->f_mode & FMODE_WRITE))
+        return -EBADF;
+    if (idle > INT_MAX / HZ)
+        return -EINVAL;
+    return scull_set_zip(filp->private_data, idle);
+}
+
+// 处理SCULL_IOCSEEK, 经由scull_llseek查找数据区或空洞
+static int scull_ioctl_seek(struct file *filp, struct scull_seek __user *arg)
+{
+    struct scull_seek sk;
+    loff_t pos;
+
+    if (filp->f_op == &scull_pipe_fops)
+        return -ENOTTY;
+    if (copy_from_user(&sk, arg, sizeof(sk)))
+        return -EFAULT;
+    if (sk.whence != SEEK_DATA && sk.whence != SEEK_HOLE)
+        return -EINVAL;
+    pos = scull_llseek(filp, sk.offset, sk.whence);
+    if (pos < 0)
+        return pos;
+    sk.offset = pos;
+    return copy_to_user(arg, &sk, sizeof(sk)) ? -EFAULT : 0;
+}
+
+// 处理SCULL_IOCCOPY, 把另一个scull设备的一段复制到本设备
+static int scull_ioctl_copy(struct file *filp, struct scull_copy __user *arg)
+{
+    struct scull_copy cp;
+    struct file *in;
+    ssize_t ret;
+
+    if (filp->f_op == &scull_pipe_fops)
+        return -ENOTTY;
+    if (!(filp->f_mode & FMODE_WRITE))
+        return -EBADF;
+    if (copy_from_user(&cp, arg, sizeof(cp)))
+        return -EFAULT;
+    if (cp.off_in < 0 || cp.off_out < 0 || cp.len < 0 ||
+            cp.off_out + cp.len < cp.off_out || (cp.flags & ~SCULL_COPY_REFLINK))
+        return -EINVAL;
+    if (cp.len > LONG_MAX)
+        cp.len = LONG_MAX;
+
+    in = fget(cp.fd_in);
+    if (!in)
+        return -EBADF;
+    if (in->f_op != &scull_fops)
+        ret = -EXDEV;   // 与copy_file_range一样, 只在同一种设备之间复制
+    else if (!(in->f_mode & FMODE_READ))
+        ret = -EBADF;
+    else
+        ret = scull_copy_range(in->private_data, cp.off_in, filp->private_data,
+                                cp.off_out, cp.len, cp.flags);
+    fput(in);
+    if (ret < 0)
+        return ret;
+    cp.len = ret;
+    return copy_to_user(arg, &cp, sizeof(cp)) ? -EFAULT : 0;
 }
 
 // ioctl 函数
@@ -456,6 +687,34 @@ int scull_ioctl(struct inode *inode, struct file *filp,
         case SCULL_P_IOCQSIZE:
             return scull_p_buffer;
 
+        case SCULL_IOCFALLOC:   // 预分配或打洞
+            return scull_ioctl_falloc(filp, (struct scull_falloc __user *)arg);
+
+        case SCULL_IOCSGEOM:    // 设置或查询本设备的几何参数
+        case SCULL_IOCGGEOM:
+            return scull_ioctl_geom(filp, cmd, (struct scull_geometry __user *)arg);
+
+        case SCULL_IOCSNAP:     // 快照到另一个设备
+            return scull_ioctl_snap(filp, arg);
+
+        case SCULL_IOCCKPT:     // 写入备份文件
+            return scull_ioctl_ckpt(filp, arg);
+
+        case SCULL_IOCLOG:      // 进入或退出日志模式
+            return scull_ioctl_log(filp, arg);
+
+        case SCULL_IOCMEMCAP:   // 设置驻留内存的上限
+            return scull_ioctl_memcap(filp, arg);
+
+        case SCULL_IOCZIP:      // 设置压缩周期
+            return scull_ioctl_zip(filp, arg);
+
+        case SCULL_IOCCOPY:     // 从另一个设备复制
+            return scull_ioctl_copy(filp, (struct scull_copy __user *)arg);
+
+        case SCULL_IOCSEEK:     // 查找数据区或空洞
+            return scull_ioctl_seek(filp, (struct scull_seek __user *)arg);
+
         default:  // 冗余, 因为cmd已根据MAXNR检查过了
             return -ENOTTY;
     }
@@ -478,6 +737,12 @@ loff_t scull_llseek(struct file *filp, loff_t off, int whence)
         case 2: // SEEK_END
             newpos = dev->size + off;
             break;
+        case SEEK_DATA:
+        case SEEK_HOLE:
+            newpos = scull_seek_data_hole(dev, off, whence);
+            if (newpos < 0)
+                return newpos;
+            break;
         default:    //不应发生
             return -EINVAL;
     }
@@ -489,29 +754,38 @@ loff_t scull_llseek(struct file *filp, loff_t off, int whence)
 
 struct file_operations scull_fops = {
     .owner = THIS_MODULE,
- //   .llseek = scull_llseek,
+    .llseek = scull_llseek,
     .read = scull_read,
     .write = scull_write,
+    .readv = scull_readv,
+    .writev = scull_writev,
+    .sendfile = scull_sendfile,
+    .sendpage = scull_sendpage,
+    .poll = scull_poll,
    .ioctl = scull_ioctl,
+    .mmap = scull_mmap,
     .open = scull_open,
     .release = scull_release,
 };
 
-// 清理相关数据结构,同时也作为初始化失败时的处理函数
-// 因此,也需要小心清理,因为有些数据结构可能还未初始化
+// 清理相关数据结构, 只清理已经初始化的scull设备
 static void scull_cleanup_module(void)
 {
     int i;
     dev_t devno = MKDEV(scull_major, scull_minor);
 
     PDEBUG("scull exit\n");
+    // 统计文件直接读取设备结构, 先于设备移除
+    scull_stats_remove_proc();
     // 防止因初始化失败导致的未申请字符设备结构
     if (scull_devices) {
-        for (i = 0; i< scull_nr_devs; i++){
-            scull_trim(scull_devices + i);
+        for (i = 0; i< scull_nr_ready; i++){
+            scull_dev_cleanup(scull_devices + i);
             cdev_del(&scull_devices[i].cdev);
         }
         kfree(scull_devices);
+        scull_devices = NULL;
+        scull_nr_ready = 0;
     }
 #ifdef SCULL_DEBUG
    scull_remove_proc();
@@ -521,6 +795,10 @@ static void scull_cleanup_module(void)
     // 清理其他设备
    scull_p_cleanup();    
    scull_access_cleanup()  ;
+    // 所有设备的后台释放都已完成
+    if (scull_wq)
+        destroy_workqueue(scull_wq);
+    scull_qset_caches_destroy();
 }
 
 // 设置字符设备结构
@@ -561,18 +839,40 @@ static int scull_init_module(void)
     scull_devices = kmalloc(scull_nr_devs * sizeof(struct scull_dev), GFP_KERNEL);
     if(!scull_devices) {
         result = -ENOMEM;
-        goto fail;
+        goto fail_region;
     }
     memset(scull_devices, 0, scull_nr_devs * sizeof(struct scull_dev));
 
+    // 后台释放数据的工作队列
+    scull_wq = create_singlethread_workqueue("scull");
+    if (!scull_wq) {
+        result = -ENOMEM;
+        goto fail_devices;
+    }
+
     /* 
      * 初始化设备
      */
     for (i = 0; i< scull_nr_devs; i++) {
-        scull_devices[i].quantum = scull_quantum;
-        scull_devices[i].qset = scull_qset;
-        init_MUTEX(&scull_devices[i].sem);
+        scull_dev_init(&scull_devices[i]);
+        result = scull_tier_setup(&scull_devices[i], i);
+        if (result)
+            printk(KERN_NOTICE "scull%d: no swap file, error %d\n", i, result);
+        if (scull_zip_idle > 0) {
+            result = scull_set_zip(&scull_devices[i], scull_zip_idle);
+            if (result)
+                printk(KERN_NOTICE "scull%d: no compressor, error %d\n",
+                        i, result);
+        }
+        // 在设备对用户可见之前恢复内容
+        if (scull_backing && scull_restore) {
+            result = scull_ckpt_restore(&scull_devices[i]);
+            if (result)
+                printk(KERN_NOTICE "scull%d: not restored, error %d\n",
+                        i, result);
+        }
         scull_setup_cdev(&scull_devices[i], i);
+        scull_nr_ready = i + 1;
     }
 
     // 初始化其他设备,pipe和access
@@ -582,11 +882,31 @@ static int scull_init_module(void)
 #ifdef SCULL_DEBUG  //调试时启用
    scull_create_proc();
 #endif
+    scull_stats_create_proc();
     return 0;   //初始化成功
-fail:
-    scull_cleanup_module();
+
+    // 失败时只撤销已经完成的步骤, 此时还没有初始化任何设备
+fail_devices:
+    kfree(scull_devices);
+    scull_devices = NULL;
+fail_region:
+    unregister_chrdev_region(dev, scull_nr_devs);
     return result;
 }
 
+// 卸载模块, 需要时先把各设备的修改写入备份文件
+static void scull_exit_module(void)
+{
+    int i, err;
+
+    for (i = 0; scull_backing && scull_ckpt_unload && i < scull_nr_devs; i++) {
+        err = scull_checkpoint(scull_devices + i, SCULL_CKPT_INCREMENTAL);
+        if (err)
+            printk(KERN_WARNING "scull%d: checkpoint failed, error %d\n",
+                    i, err);
+    }
+    scull_cleanup_module();
+}
+
 module_init(scull_init_module);
-module_exit(scull_cleanup_module);
+module_exit(scull_exit_module);
@@ -0,0 +1,122 @@
+/*
+ * mmap.c -- scull设备的内存映射
+ * 量子为页对齐时, 缺页处理直接把量子所在的物理页映射给用户进程
+ */
+
+#include <linux/module.h>
+#include <linux/mm.h>
+#include <linux/fs.h>
+#include <linux/errno.h>
+#include <linux/cdev.h>
+#include <linux/rcupdate.h>
+#include <asm/pgtable.h>
+
+#include "scull.h"
+
+// 打开/关闭函数: 跟踪设备上活动映射的数量, 有映射时scull_trim拒绝清理
+void scull_vma_open(struct vm_area_struct *vma)
+{
+    struct scull_dev *dev = vma->vm_private_data;
+    atomic_inc(&dev->vmas);
+}
+
+void scull_vma_close(struct vm_area_struct *vma)
+{
+    struct scull_dev *dev = vma->vm_private_data;
+    atomic_dec(&dev->vmas);
+}
+
+/**
+ * 缺页处理: 超出设备大小时发送SIGBUS
+ * 落在空洞上时私有映射映射零页; 共享映射要看到之后write()填入的数据,
+ * 即使只读也不能映射零页, 先为空洞预分配量子(内容为0)再映射
+ */
+struct page *scull_vma_nopage(struct vm_area_struct *vma,
+                                unsigned long address, int *type)
+{
+    struct scull_dev *dev = vma->vm_private_data;
+    struct scull_index *idx;
+    struct page *page = NOPAGE_SIGBUS;
+    unsigned long offset;
+    int q_pos, filled = 0, retval;
+    char *q;
+
+    offset = (address - vma->vm_start) + (vma->vm_pgoff << PAGE_SHIFT);
+again:
+    // 映射存在期间量子不会被释放, 查找过程与读者一样只需RCU保护
+    rcu_read_lock();
+    if (offset >= dev->size)
+        goto out;
+    smp_rmb();
+    idx = rcu_dereference(dev->data);
+    q = idx ? scull_lookup(idx, offset, &q_pos) : NULL;
+    // 映射时已经调入了所有量子, 映射期间也不会换出或压缩
+    if (scull_quantum_cold(q))
+        goto out;
+
+    if (!q) {
+        if (vma->vm_flags & VM_SHARED) {
+            rcu_read_unlock();
+            if (filled)     // 预分配后又成了空洞
+                return NOPAGE_SIGBUS;
+            retval = scull_prealloc(dev, offset & PAGE_MASK, PAGE_SIZE,
+                                    SCULL_FALLOC_KEEP_SIZE);
+            if (retval)
+                return retval == -ENOMEM ? NOPAGE_OOM : NOPAGE_SIGBUS;
+            filled = 1;
+            goto again;
+        }
+        // 私有映射写入时由缺页处理复制零页
+        page = ZERO_PAGE(address);
+    } else {
+        // 高阶量子由__GFP_COMP申请, get_page会增加复合页首页的引用计数;
+        // 回退到vmalloc的量子由独立的页组成
+        page = scull_quantum_page(q + q_pos);
+    }
+    get_page(page);
+    if (type)
+        *type = VM_FAULT_MINOR;
+out:
+    rcu_read_unlock();
+    return page;
+}
+
+struct vm_operations_struct scull_vm_ops = {
+    .open   =   scull_vma_open,
+    .close  =   scull_vma_close,
+    .nopage =   scull_vma_nopage,
+};
+
+int scull_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+    struct scull_dev *dev = filp->private_data;
+    int retval;
+
+    // 持有dev->sem, 防止检查之后scull_trim修改量子大小
+    if (down_interruptible(&dev->sem))
+        return -ERESTARTSYS;
+    // 只有页对齐的量子才能直接映射
+    if (!scull_quantum_paged(dev->quantum)) {
+        up(&dev->sem);
+        return -ENODEV;
+    }
+    // 日志模式下的写入必须经过追加, 不能通过共享映射绕过水位;
+    // 只读的共享映射也去掉VM_MAYWRITE, 之后不能用mprotect改为可写
+    if (dev->log_mode && (vma->vm_flags & VM_SHARED)) {
+        if (vma->vm_flags & VM_WRITE) {
+            up(&dev->sem);
+            return -EPERM;
+        }
+        vma->vm_flags &= ~VM_MAYWRITE;
+    }
+    vma->vm_ops = &scull_vm_ops;
+    vma->vm_flags |= VM_RESERVED;
+    vma->vm_private_data = dev;
+    scull_vma_open(vma);
+    // 全0标记没有可以映射的页, 共享的量子不能被直接写入, 先换成私有的量子
+    retval = scull_unshare(dev);
+    if (retval)
+        scull_vma_close(vma);
+    up(&dev->sem);
+    return retval;
+}
@@ -17,6 +17,8 @@
 #include <linux/cdev.h> //struct cdev 等
 #include <linux/proc_fs.h>
 #include <linux/poll.h>
+#include <linux/mm.h>       // alloc_page()
+#include <linux/highmem.h>  // kmap()
 
 
 #include "scull.h"
@@ -98,16 +100,9 @@ static int scull_p_release(struct inode *inode, struct file *filp)
     return 0;
 }
 
-// 读取函数
-static ssize_t scull_p_read(struct file *filp, char __user *buf, size_t count,
-                            loff_t *f_ops)
+// 等待有数据可读, 返回0时持有信号量, 出错时已经释放了信号量
+static int scull_getreaddata(struct scull_pipe *dev, struct file *filp)
 {
-    struct scull_pipe *dev = filp->private_data;
-
-    // 互斥访问设备
-    if (down_interruptible(&dev->sem))
-        return -ERESTARTSYS;
-    
     while (dev->rp == dev->wp) {    // 无数据可读
         up(&dev->sem);  // 释放信号量
         if (filp->f_flags & O_NONBLOCK)
@@ -119,6 +114,23 @@ static ssize_t scull_p_read(struct file *filp, char __user *buf, size_t count,
         if (down_interruptible(&dev->sem))
             return -ERESTARTSYS;
     }
+    return 0;
+}
+
+// 读取函数
+static ssize_t scull_p_read(struct file *filp, char __user *buf, size_t count,
+                            loff_t *f_ops)
+{
+    struct scull_pipe *dev = filp->private_data;
+    int result;
+
+    // 互斥访问设备
+    if (down_interruptible(&dev->sem))
+        return -ERESTARTSYS;
+    
+    result = scull_getreaddata(dev, filp);
+    if (result)
+        return result;  // scull_getreaddata 调用了up
     // 确定此时有数据
     if (dev->wp > dev->rp)
         count = min(count, (size_t)(dev->wp - dev->rp));
@@ -218,6 +230,77 @@ static ssize_t scull_p_write(struct file *filp, const char __user *buf, size_t c
     return count;
 }
 
+/**
+ * sendfile: 每次把读指针处最多一页数据复制到新申请的页交给actor, 不经过用户空间
+ * 环形缓冲区由kmalloc申请, 其中的页不能被actor引用(如网络协议栈保留到发送完成),
+ * 因此每页单独申请, actor取得的引用在其释放后才归还该页
+ */
+static ssize_t scull_p_sendfile(struct file *filp, loff_t *ppos, size_t count,
+                                read_actor_t actor, void *target)
+{
+    struct scull_pipe *dev = filp->private_data;
+    read_descriptor_t desc;
+    unsigned long avail, len, ret;
+    struct page *page;
+    int result;
+
+    desc.written = 0;
+    desc.count = count;
+    desc.arg.data = target;
+    desc.error = 0;
+
+    if (down_interruptible(&dev->sem))
+        return -ERESTARTSYS;
+    result = scull_getreaddata(dev, filp);
+    if (result)
+        return result;  // scull_getreaddata 调用了up
+
+    while (desc.count && dev->rp != dev->wp) {
+        // 每次最多交出读指针所在的一页, 不能越过写指针或缓冲区末尾
+        if (dev->wp > dev->rp)
+            avail = dev->wp - dev->rp;
+        else
+            avail = dev->end - dev->rp;
+        len = min(desc.count, (size_t)min(avail, PAGE_SIZE));
+        page = alloc_page(GFP_KERNEL);
+        if (!page) {
+            desc.error = -ENOMEM;
+            break;
+        }
+        memcpy(page_address(page), dev->rp, len);
+        ret = actor(&desc, page, 0, len);
+        put_page(page);
+        dev->rp += ret;
+        if (dev->rp == dev->end) //读指针环回
+            dev->rp = dev->buffer;
+        if (ret != len || desc.error)   // 目标已满或出错
+            break;
+    }
+    up(&dev->sem);
+    // 唤醒写进程
+    wake_up_interruptible(&dev->outq);
+    if (desc.written)
+        return desc.written;
+    return desc.error;
+}
+
+// sendpage: 作为sendfile的目标, 复用scull_p_write, 可能只接收一部分
+static ssize_t scull_p_sendpage(struct file *filp, struct page *page, int offset,
+                                size_t size, loff_t *ppos, int more)
+{
+    mm_segment_t old_fs;
+    ssize_t retval;
+    char *kaddr;
+
+    kaddr = kmap(page);
+    old_fs = get_fs();
+    set_fs(KERNEL_DS);
+    retval = scull_p_write(filp, (const char __user *)(kaddr + offset), size, ppos);
+    set_fs(old_fs);
+    kunmap(page);
+    return retval;
+}
+
 static unsigned int scull_p_poll(struct file *filp, poll_table *wait)
 {
     struct scull_pipe *dev = filp->private_data;
@@ -291,6 +374,8 @@ struct file_operations scull_pipe_fops = {
     .llseek =   no_llseek,
     .read   =   scull_p_read,
     .write  =   scull_p_write,
+    .sendfile   =   scull_p_sendfile,
+    .sendpage   =   scull_p_sendpage,
     .poll   =   scull_p_poll,
     .ioctl  =   scull_ioctl,
     .open   =   scull_p_open,
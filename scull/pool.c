@@ -0,0 +1,403 @@
+/*
+ * pool.c -- scull设备的量子池
+ * 每个设备保留一些空闲的量子, 写入时优先从池中取,
+ * trim时优先归还到池中, 避免写入突发时频繁调用内存分配器
+ * 低于scull_pool_min时由工作队列在后台补充, 超过scull_pool_max个或
+ * scull_pool_bytes字节的部分直接归还给分配器; 池空闲一段时间后
+ * 只保留scull_pool_min个量子
+ * 量子大小为PAGE_SIZE << n时, 量子由页分配器申请(order n)
+ */
+
+#include "shim.h"
+#ifdef __KERNEL__
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/vmalloc.h>
+#endif
+
+#include "scull.h"
+#include "trace.h"
+
+int scull_pool_min = SCULL_POOL_MIN;    // 低水位, 低于此值时后台补充
+int scull_pool_max = SCULL_POOL_MAX;    // 高水位, 超出部分直接释放
+int scull_pool_bytes = SCULL_POOL_BYTES;    // 池中空闲量子的总字节数上限
+
+module_param(scull_pool_min, int, S_IRUGO | S_IWUSR);
+module_param(scull_pool_max, int, S_IRUGO | S_IWUSR);
+module_param(scull_pool_bytes, int, S_IRUGO | S_IWUSR);
+
+// 量子大小为页面的2的幂次倍时使用页分配器, 这样的量子页对齐, 可以被mmap
+int scull_quantum_paged(int quantum)
+{
+    return quantum >= PAGE_SIZE && quantum == (PAGE_SIZE << get_order(quantum));
+}
+
+// 量子是否是高阶申请失败后回退到vmalloc得到的
+static inline int scull_quantum_vmalloced(const void *q)
+{
+    return (unsigned long)q >= VMALLOC_START && (unsigned long)q < VMALLOC_END;
+}
+
+#ifdef __KERNEL__
+// 返回页对齐量子中addr所在的页, 调用者保证量子不会被释放
+struct page *scull_quantum_page(const void *addr)
+{
+    if (scull_quantum_vmalloced(addr))
+        return vmalloc_to_page((void *)addr);
+    return virt_to_page(addr);
+}
+
+/**
+ * 页对齐的量子是否仍被其他地方引用, 如sendfile交给actor的页
+ * 这样的量子不能放回池中重用; 释放时只减少引用计数, 引用者放手后页面才归还
+ * 复合页的引用计在首页上, vmalloc得到的量子要逐页检查
+ */
+static int scull_quantum_busy(void *q, int quantum)
+{
+    int i;
+
+    if (!scull_quantum_paged(quantum))
+        return 0;
+    if (!scull_quantum_vmalloced(q))
+        return page_count(virt_to_page(q)) > 1;
+    for (i = 0; i < quantum; i += PAGE_SIZE)
+        if (page_count(vmalloc_to_page(q + i)) > 1)
+            return 1;
+    return 0;
+}
+#else
+#define scull_quantum_busy(q, quantum)	0
+#endif
+
+/**
+ * 直接从分配器申请一个量子
+ * 大量子(如2MB, order 9)优先申请物理连续的高阶页, 内存碎片化时
+ * 不反复回收内存, 而是回退到vmalloc, 由order 0的页拼成虚拟连续的量子
+ */
+static void *scull_alloc_quantum(struct scull_pool *pool, int quantum)
+{
+    int order = get_order(quantum);
+    void *q;
+
+    if (!scull_quantum_paged(quantum))
+        return kmalloc(quantum, GFP_KERNEL);
+    if (order == 0) {
+        q = (void *)__get_free_page(GFP_KERNEL);
+    } else {
+        q = (void *)__get_free_pages(GFP_KERNEL | __GFP_COMP |
+                        __GFP_NOWARN | __GFP_NORETRY, order);
+        if (q) {
+            atomic_inc(&pool->nr_high);
+        } else {
+            q = vmalloc(quantum);
+            if (q)
+                atomic_inc(&pool->nr_fallback);
+        }
+    }
+    // 页对齐的量子可能被映射到用户空间, 不能带有旧数据
+    if (q)
+        memset(q, 0, quantum);
+    return q;
+}
+
+// 直接把量子还给分配器
+static void scull_free_quantum(struct scull_pool *pool, void *q, int quantum)
+{
+    if (!scull_quantum_paged(quantum)) {
+        kfree(q);
+    } else if (scull_quantum_vmalloced(q)) {
+        vfree(q);
+        atomic_dec(&pool->nr_fallback);
+    } else {
+        free_pages((unsigned long)q, get_order(quantum));
+        if (get_order(quantum))
+            atomic_dec(&pool->nr_high);
+    }
+}
+
+/**
+ * 释放池中所有与给定量子大小不符的量子, 调用者持有pool->lock
+ * 空闲量子的首个字用作链表指针
+ */
+static void scull_pool_reshape(struct scull_pool *pool, int quantum)
+{
+    void *p;
+
+    if (pool->quantum == quantum)
+        return;
+    while ((p = pool->quanta) != NULL) {
+        pool->quanta = *(void **)p;
+        scull_free_quantum(pool, p, pool->quantum);
+    }
+    pool->nr_quanta = 0;
+    pool->quantum = quantum;
+}
+
+// 池中是否还能再放一个量子而不超过want个和scull_pool_bytes字节, 调用者持有pool->lock
+static inline int scull_pool_room(struct scull_pool *pool, int want)
+{
+    return pool->nr_quanta < want &&
+        (long)(pool->nr_quanta + 1) * pool->quantum <= scull_pool_bytes;
+}
+
+// 工作队列函数: 把池补充到低水位
+static void scull_pool_refill(void *data)
+{
+    struct scull_pool *pool = data;
+    int quantum;
+    void *p;
+
+    for (;;) {
+        spin_lock(&pool->lock);
+        quantum = pool->quantum;
+        if (!quantum || !scull_pool_room(pool, scull_pool_min)) {
+            spin_unlock(&pool->lock);
+            break;
+        }
+        spin_unlock(&pool->lock);
+
+        p = scull_alloc_quantum(pool, quantum);
+        if (!p)
+            break;
+        spin_lock(&pool->lock);
+        if (pool->quantum != quantum || !scull_pool_room(pool, scull_pool_max)) {
+            spin_unlock(&pool->lock);
+            scull_free_quantum(pool, p, quantum);
+            break;
+        }
+        *(void **)p = pool->quanta;
+        pool->quanta = p;
+        pool->nr_quanta++;
+        pool->refills++;
+        spin_unlock(&pool->lock);
+    }
+}
+
+/**
+ * 工作队列函数: 池空闲SCULL_POOL_IDLE秒后, 把超出低水位的量子还给分配器
+ * 期间有过取出或归还时推迟到空闲满SCULL_POOL_IDLE秒; 池已清空时不再提交
+ */
+static void scull_pool_trim(void *data)
+{
+    struct scull_pool *pool = data;
+    unsigned long now = jiffies, idle;
+    void *p, *list = NULL;
+    int quantum;
+
+    spin_lock(&pool->lock);
+    idle = pool->last_used + SCULL_POOL_IDLE * HZ;
+    if (pool->quantum && time_before(now, idle)) {
+        // 在锁内提交, scull_pool_drain清空池后取消的工作不会再被提交
+        schedule_delayed_work(&pool->trim_work, idle - now);
+        spin_unlock(&pool->lock);
+        return;
+    }
+    while (pool->nr_quanta > scull_pool_min) {
+        p = pool->quanta;
+        pool->quanta = *(void **)p;
+        pool->nr_quanta--;
+        pool->frees++;
+        *(void **)p = list;
+        list = p;
+    }
+    quantum = pool->quantum;
+    pool->trim_queued = 0;
+    spin_unlock(&pool->lock);
+
+    while ((p = list) != NULL) {
+        list = *(void **)p;
+        scull_free_quantum(pool, p, quantum);
+    }
+}
+
+void scull_pool_init(struct scull_pool *pool)
+{
+    memset(pool, 0, sizeof(struct scull_pool));
+    spin_lock_init(&pool->lock);
+    INIT_WORK(&pool->refill_work, scull_pool_refill, pool);
+    INIT_WORK(&pool->trim_work, scull_pool_trim, pool);
+}
+
+// 申请一个量子, 池为空时直接向分配器申请
+void *scull_pool_get_quantum(struct scull_pool *pool, int quantum)
+{
+    struct scull_dev *dev = container_of(pool, struct scull_dev, pool);
+    u64 start = scull_now();
+    void *q;
+    int refill;
+
+    spin_lock(&pool->lock);
+    if (pool->quantum != quantum)
+        scull_pool_reshape(pool, quantum);
+    q = pool->quanta;
+    if (q) {
+        pool->quanta = *(void **)q;
+        pool->nr_quanta--;
+        pool->hits++;
+    } else {
+        pool->misses++;
+    }
+    pool->last_used = jiffies;
+    refill = scull_pool_room(pool, scull_pool_min);
+    spin_unlock(&pool->lock);
+
+    if (refill)
+        schedule_work(&pool->refill_work);
+    if (!q) {
+        q = scull_alloc_quantum(pool, quantum);
+        if (q)
+            atomic_long_add(quantum, &pool->in_use);
+        trace_scull_quantum_alloc(SCULL_MINOR(dev), quantum, 0,
+                                    scull_now() - start);
+        return q;
+    }
+    atomic_long_add(quantum, &pool->in_use);
+    if (scull_quantum_paged(quantum))
+        memset(q, 0, quantum);  // 与scull_alloc_quantum一致, 不泄露旧数据
+    trace_scull_quantum_alloc(SCULL_MINOR(dev), quantum, 1, scull_now() - start);
+    return q;
+}
+
+// 归还一个量子, 池已满或量子的页仍被引用时直接释放
+void scull_pool_put_quantum(struct scull_pool *pool, void *q, int quantum)
+{
+    int busy;
+
+    if (!q)
+        return;
+    atomic_long_sub(quantum, &pool->in_use);
+    busy = scull_quantum_busy(q, quantum);
+    spin_lock(&pool->lock);
+    pool->last_used = jiffies;
+    if (!busy && pool->quantum == quantum && scull_pool_room(pool, scull_pool_max)) {
+        *(void **)q = pool->quanta;
+        pool->quanta = q;
+        pool->nr_quanta++;
+        if (pool->nr_quanta > scull_pool_min && !pool->trim_queued) {
+            pool->trim_queued = 1;
+            schedule_delayed_work(&pool->trim_work, SCULL_POOL_IDLE * HZ);
+        }
+        spin_unlock(&pool->lock);
+        return;
+    }
+    pool->frees++;
+    spin_unlock(&pool->lock);
+    scull_free_quantum(pool, q, quantum);
+}
+
+// 释放池中的全部对象并取消空闲释放的工作, 调用者保证补充工作不再运行
+void scull_pool_drain(struct scull_pool *pool)
+{
+    spin_lock(&pool->lock);
+    scull_pool_reshape(pool, 0);
+    spin_unlock(&pool->lock);
+    cancel_delayed_work(&pool->trim_work);
+    flush_scheduled_work();     // 已经开始的工作看到池已清空, 不再提交
+}
+
+/**
+ * 量子集节点的slab缓存
+ * 节点中直接包含qset个量子指针, 脏位图, 引用位图和共享位图, 大小随qset变化, 每种qset一个kmem_cache
+ * 几何参数通常只有少数几种, 缓存保存在一个只增不减的小数组中,
+ * 查找时不加锁; 数组满了以后新的qset改用kmalloc, 模块卸载时销毁所有缓存
+ */
+#define SCULL_QSET_CACHES 8
+
+static struct scull_qset_cache {
+    int qset;                   // 为0表示空项, 在cache之后设置
+    kmem_cache_t *cache;
+    char name[24];
+} scull_qset_caches[SCULL_QSET_CACHES];
+static DECLARE_MUTEX(scull_qset_cache_sem);
+
+static inline size_t scull_qset_size(int qset)
+{
+    return sizeof(struct scull_qset) + qset * sizeof(void *) +
+            3 * BITS_TO_LONGS(qset) * sizeof(long);
+}
+
+// 查找qset对应的缓存, create非0时按需创建
+static kmem_cache_t *scull_qset_cache(int qset, int create)
+{
+    struct scull_qset_cache *c;
+    kmem_cache_t *cache = NULL;
+    int i;
+
+    for (i = 0; i < SCULL_QSET_CACHES; i++) {
+        c = &scull_qset_caches[i];
+        if (c->qset == qset) {
+            smp_rmb();
+            return c->cache;
+        }
+    }
+    if (!create)
+        return NULL;
+
+    down(&scull_qset_cache_sem);
+    for (i = 0; i < SCULL_QSET_CACHES; i++) {
+        c = &scull_qset_caches[i];
+        if (c->qset == qset) {
+            cache = c->cache;
+            break;
+        }
+        if (c->qset == 0) {
+            sprintf(c->name, "scull_qset_%i", qset);
+            cache = kmem_cache_create(c->name, scull_qset_size(qset), 0,
+                                    SLAB_HWCACHE_ALIGN, NULL, NULL);
+            if (cache) {
+                c->cache = cache;
+                smp_wmb();  // 先让cache可见, 再让查找者匹配到qset
+                c->qset = qset;
+            }
+            break;
+        }
+    }
+    up(&scull_qset_cache_sem);
+    return cache;
+}
+
+// 申请一个量子指针全为NULL的量子集节点
+struct scull_qset *scull_qset_alloc(int qset)
+{
+    kmem_cache_t *cache = scull_qset_cache(qset, 1);
+    struct scull_qset *qs;
+
+    if (cache)
+        qs = kmem_cache_alloc(cache, GFP_KERNEL);
+    else
+        qs = kmalloc(scull_qset_size(qset), GFP_KERNEL);
+    if (!qs)
+        return NULL;
+    memset(qs, 0, scull_qset_size(qset));
+    init_MUTEX(&qs->sem);
+    qs->cache = cache;
+    return qs;
+}
+
+// 按申请时记录的来源释放, 缓存表在两次之间可能新增了该qset的缓存
+void scull_qset_free(struct scull_qset *qs, int qset)
+{
+    if (qs->cache)
+        kmem_cache_free(qs->cache, qs);
+    else
+        kfree(qs);
+}
+
+// 一个量子集节点占用的内存
+size_t scull_qset_bytes(int qset)
+{
+    return scull_qset_size(qset);
+}
+
+// 销毁所有缓存, 调用者保证所有节点都已释放
+void scull_qset_caches_destroy(void)
+{
+    int i;
+
+    for (i = 0; i < SCULL_QSET_CACHES; i++) {
+        if (scull_qset_caches[i].cache)
+            kmem_cache_destroy(scull_qset_caches[i].cache);
+        scull_qset_caches[i].cache = NULL;
+        scull_qset_caches[i].qset = 0;
+    }
+}
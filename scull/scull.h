@@ -10,6 +10,13 @@
 #define _SCULL_H_
 
 #include <linux/ioctl.h> // _IOW等宏需要的头文件
+#ifdef __KERNEL__
+#include <linux/rcupdate.h>
+#include <linux/workqueue.h>
+#include <asm/div64.h>		// do_div()
+#else
+#include "shim.h"	// 在用户空间编译存储引擎时代替内核头文件
+#endif
 
 // 与调试输出相关的宏
 
@@ -45,6 +52,9 @@
  *  定义量子集个数和量子大小
  * scull_dev->data 指向了一个指针数组
  * 该数组有SCULL_QSET项,每个指针执行的内存大小为SCULL_QUANTUM字节
+ * 默认的量子大小不是页对齐的; 需要mmap时以scull_quantum=4096
+ * (或PAGE_SIZE的其他2的幂次倍)加载模块, 量子将从页分配器申请
+ * 大量子(如scull_quantum=2097152)使用高阶页, 申请失败时回退到vmalloc
  */
 #ifndef SCULL_QUANTUM
 #define SCULL_QUANTUM 4000
@@ -54,6 +64,62 @@
 #define SCULL_QSET	1000
 #endif
 
+/**
+ * 每个设备可以通过ioctl设置自己的几何参数, 已有数据由后台重整
+ * 量子的首个字在池中用作链表指针, 因此不能小于SCULL_QUANTUM_MIN;
+ * 量子集节点(连同qset个量子指针)由slab缓存申请, 单个slab对象不超过128KB,
+ * qset不能超过SCULL_QSET_MAX
+ */
+#define SCULL_QUANTUM_MIN	16
+#define SCULL_QSET_MAX		8192
+
+/**
+ * 自动模式: 每SCULL_AUTO_INTERVAL次写入根据平均写入大小选择量子大小
+ * (SCULL_AUTO_QMIN到SCULL_AUTO_QMAX之间的2的幂), 每个量子集约SCULL_AUTO_ITEM字节
+ */
+#ifndef SCULL_AUTO_INTERVAL
+#define SCULL_AUTO_INTERVAL	256
+#endif
+#define SCULL_AUTO_QMIN		512
+#define SCULL_AUTO_QMAX		(1 << 20)
+#define SCULL_AUTO_ITEM		(4 << 20)
+
+// 打洞时每攒够这么多量子等待一次宽限期
+#ifndef SCULL_PUNCH_BATCH
+#define SCULL_PUNCH_BATCH 512
+#endif
+
+// 读者每复制这么多字节离开一次RCU读临界区, 限制关闭抢占的时间
+#ifndef SCULL_READ_BATCH
+#define SCULL_READ_BATCH (64 * 1024)
+#endif
+
+// 设备之间复制数据时每次经由内核缓冲区搬运的字节数
+#ifndef SCULL_COPY_CHUNK
+#define SCULL_COPY_CHUNK (1 << 20)
+#endif
+
+/**
+ * 量子池的低水位和高水位(每个设备的空闲量子数)
+ */
+#ifndef SCULL_POOL_MIN
+#define SCULL_POOL_MIN 32
+#endif
+
+#ifndef SCULL_POOL_MAX
+#define SCULL_POOL_MAX 1024
+#endif
+
+/**
+ * 量子池中空闲量子的总字节数上限, 大量子时高水位由此决定
+ * 池在SCULL_POOL_IDLE秒内没有取出或归还量子时, 超出低水位的部分被释放
+ */
+#ifndef SCULL_POOL_BYTES
+#define SCULL_POOL_BYTES (8 << 20)
+#endif
+
+#define SCULL_POOL_IDLE 5
+
 /**
  * pipe设备的存储区域是一个简单的唤醒缓冲区
  * 此处设置大小
@@ -62,23 +128,259 @@
 #define SCULL_P_BUFFER 4000
 #endif
 
-// 量子集数组单项标识
+/**
+ * 量子集索引数组的初始容量
+ * 容量不足时按2倍扩展, 项号直接作为下标, 定位代价与偏移量无关
+ */
+#ifndef SCULL_INDEX_MIN
+#define SCULL_INDEX_MIN 16
+#endif
+
+/**
+ * 内容全为0的量子不占用内存, 在量子集中以SCULL_ZERO_QUANTUM标记,
+ * 读者把它当作空洞读出0, 下一次写入非0数据时才申请真正的量子.
+ * 标记不能被解引用, 也不能归还到量子池
+ * 设备被映射期间不产生新的标记, 映射时已有的标记被替换为真正的量子
+ */
+#define SCULL_ZERO_QUANTUM	((void *)1)
+
+/**
+ * 被换出到交换文件的量子以SCULL_SWAPPED_QUANTUM标记, 内容保存在交换文件中
+ * 与量子在设备中的偏移相同的位置, 访问时由tier.c调入. 与全0标记一样
+ * 不能被解引用, 也不能归还到量子池
+ */
+#define SCULL_SWAPPED_QUANTUM	((void *)2)
+
+/**
+ * 被压缩的量子以最低位为1的指针表示, 指向zip.c中的压缩数据, 访问时
+ * 与换出的量子一样由tier.c调入. 读者不能解引用, 也不能归还到量子池
+ */
+#define scull_quantum_zipped(q)	\
+	(((unsigned long)(q) & 1) && (q) != SCULL_ZERO_QUANTUM)
+
+// 量子指针是否指向真正的量子(不是NULL, 标记或压缩的量子)
+#define scull_quantum_real(q)	\
+	((unsigned long)(q) > (unsigned long)SCULL_SWAPPED_QUANTUM && \
+	 !((unsigned long)(q) & 1))
+
+// 量子的内容不在内存中, 访问前必须用scull_tier_load调入
+#define scull_quantum_cold(q)	\
+	((q) == SCULL_SWAPPED_QUANTUM || scull_quantum_zipped(q))
+
+/**
+ * 量子集数组单项标识
+ * 每个量子集有自己的信号量, 写入不同量子集的写者可以并行
+ * 量子指针直接跟在节点之后, 节点与指针数组一次申请, 定位量子少一次
+ * 间接访问; 节点由按qset区分的slab缓存申请(见pool.c)
+ */
 struct scull_qset {
-	void **data;
-	struct scull_qset *next;
+	struct semaphore sem;		// 保护本量子集内量子的申请和写入
+	kmem_cache_t *cache;		// 申请节点的slab缓存, NULL表示由kmalloc申请
+	void *data[0];				// qset个量子指针, RCU保护
+};
+
+/**
+ * 量子指针之后是脏位图, 第i位表示第i个量子自上次检查点以来被修改过
+ * 在dptr->sem保护下设置和清除
+ */
+static inline unsigned long *scull_qset_dirty(struct scull_qset *qs, int qset)
+{
+	return (unsigned long *)&qs->data[qset];
+}
+
+/**
+ * 脏位图之后是引用位图, 供分层存储的CLOCK算法使用: 访问量子时置位,
+ * 换出者扫过时清除, 扫过两次都没有被访问的量子被换出. 压缩也据此判断
+ * 量子在一个周期内是否被访问过. 不加锁设置
+ */
+static inline unsigned long *scull_qset_ref(struct scull_qset *qs, int qset)
+{
+	return scull_qset_dirty(qs, qset) + BITS_TO_LONGS(qset);
+}
+
+/**
+ * 引用位图之后是共享位图, 第i位表示第i个量子可能与其他设备共享
+ * 快照和reflink共享量子时在两边的量子集中置位, 写者只有遇到置位的量子
+ * 才查全局散列表(见cow.c). 在dptr->sem保护下设置和清除
+ */
+static inline unsigned long *scull_qset_shared(struct scull_qset *qs, int qset)
+{
+	return scull_qset_ref(qs, qset) + BITS_TO_LONGS(qset);
+}
+
+/**
+ * 量子集索引, 以项号为下标的指针数组
+ * 读者在RCU保护下访问, 不获取信号量; 容量不足时写者
+ * 发布一个更大的新数组, 旧数组在宽限期结束后释放
+ * 几何参数随索引保存, 读者无需读取可能已被scull_trim修改的dev->quantum
+ */
+struct scull_index {
+	struct scull_dev *dev;		// 所属设备
+	int quantum;				// 量子大小
+	int qset;					// 量子集数组大小
+	int nitems;					// items容量
+	struct rcu_head rcu;
+	struct work_struct free_work;	// 被trim摘下后在后台释放
+	struct scull_qset *items[0];
+};
+
+/**
+ * 量子池, 缓存空闲的量子
+ * 池中的量子只对应一种量子大小, 大小变化时旧量子被释放
+ */
+struct scull_pool {
+	spinlock_t lock;
+	void *quanta;				// 空闲量子链表, 首个字为next指针
+	int nr_quanta;				// 空闲量子的数量
+	int quantum;				// 池中量子的大小
+	unsigned long hits, misses;	// 从池中取到 / 未取到的次数
+	unsigned long refills;		// 后台补充的量子数
+	unsigned long frees;		// 池满或空闲时释放的量子数
+	unsigned long last_used;	// 最近一次取出或归还量子的时间(jiffies)
+	int trim_queued;			// 空闲释放的工作是否已提交
+	atomic_t nr_high;			// 现存的高阶(order > 0)量子数
+	atomic_t nr_fallback;		// 现存的回退到vmalloc(order 0)的量子数
+	atomic_long_t in_use;		// 设备引用的量子字节数, 包括与其他设备共享的
+	struct work_struct refill_work;
+	struct work_struct trim_work;	// 空闲时释放超出低水位的量子
+};
+
+/**
+ * 按CPU保存的统计信息, 由stats.c维护
+ * hist为各操作的延迟直方图, 第i个桶记录 [2^(i-1), 2^i) 纳秒
+ */
+enum {
+	SCULL_OP_READ,
+	SCULL_OP_WRITE,
+	SCULL_OP_TRIM,
+	SCULL_OP_INFLATE,		// 解压一个量子
+	SCULL_NR_OPS
+};
+
+// 分层存储的事件, 见scull_stat_tier
+enum {
+	SCULL_TIER_HIT,
+	SCULL_TIER_MISS,
+	SCULL_TIER_EVICT
+};
+
+#define SCULL_HIST_BUCKETS	32
+
+struct scull_cpu_stats {
+	unsigned long ops[SCULL_NR_OPS];			// 操作次数
+	unsigned long long bytes[SCULL_NR_OPS];	// 读写的字节数
+	unsigned long short_reads;					// 读到的字节数少于请求的次数
+	unsigned long alloc_fails;					// 申请量子或量子集失败的次数
+	unsigned long zero_dedups;					// 全0写入以标记代替量子的次数
+	unsigned long cow_copies;					// 写入共享量子前复制的次数
+	unsigned long tier_hits;					// 访问时量子在内存中的次数
+	unsigned long tier_misses;					// 访问时从交换文件调入的次数
+	unsigned long tier_evictions;				// 换出到交换文件的量子数
+	unsigned long long sem_wait_ns;			// 在dev->sem上等待的时间
+	unsigned long hist[SCULL_NR_OPS][SCULL_HIST_BUCKETS];
+};
+
+/**
+ * 设备的内存占用, 由scull_mem_usage统计
+ * 元数据(索引和量子集节点)与数据(量子)分开计算
+ */
+struct scull_mem {
+	unsigned long index_bytes;		// 量子集索引
+	unsigned long nr_qsets;
+	unsigned long qset_bytes;		// 量子集节点, 包括其中的量子指针
+	unsigned long nr_quanta;
+	unsigned long quantum_bytes;	// 量子
+	unsigned long nr_zero;			// 以SCULL_ZERO_QUANTUM代替的全0量子
+	unsigned long nr_shared;		// nr_quanta中与其他设备共享的量子
+	unsigned long nr_swapped;		// 换出到交换文件的量子
+	unsigned long nr_zipped;		// 被压缩的量子
+	unsigned long zipped_bytes;		// 压缩后的字节数
 };
 
 // scull字符设备结构
 struct scull_dev {
-	struct scull_qset *data;	// 指向第一个量子集的指针
+	struct scull_index *data;	// 量子集索引, RCU保护
 	int quantum;				// 当前量子大小
 	int qset;					// 当前量子集数组大小
 	unsigned long size;			// 存储的数据大小
+	unsigned long gen;			// 每次scull_trim加1, 防止旧写者改写size
+	spinlock_t lock;			// 保护size, gen和目标几何参数
+	atomic_t vmas;				// 活动的映射数量, 非0时不能trim
+	int want_quantum;			// 目标几何参数, 与当前参数不同时由后台重整
+	int want_qset;
+	int own_geom;				// 使用设备自己的几何参数, trim时不恢复为全局参数
+	int auto_geom;				// 根据写入大小自动选择几何参数
+	unsigned long wavg;			// 平均写入大小(指数加权)
+	unsigned long nwrites;		// 自动模式下的写入次数
+	struct work_struct reshape_work;	// 在scull_wq中重整数据
+	int ckpt_stale;				// 备份文件已与脏位图不对应, 下次检查点必须是完整的
+	int log_mode;				// 日志模式: 只能追加, 读者只看到已提交的记录
+	volatile int log_frozen;	// 非0时新的追加等待(trim或进入日志模式), 在dev->sem下增减
+	atomic_t log_inflight;		// 已预留但未提交的追加数
+	atomic_t writers;			// 正在进行的普通写入数, 进入日志模式时等待其归零
+	atomic_long_t log_tail;		// 下一次追加的预留位置; size为已提交的水位
+	struct scull_log_range *log_pending;	// 待提交的范围, 按起点排序, 由lock保护
+	wait_queue_head_t log_wait;	// 等待水位推进的读者(poll), 等待log_frozen清除的追加,
+								// 等待普通写者结束的scull_set_log
+	struct file *swap;			// 冷量子的交换文件, 为NULL时不分层
+	unsigned long mem_cap;		// 驻留内存的量子字节数上限, 0为不限制
+	atomic_long_t tier_pending;	// 已换出或压缩但还在等待宽限期释放的字节数
+	int tier_item, tier_slot;	// CLOCK指针: 下一个检查的量子集和量子
+	struct work_struct tier_work;	// 在scull_wq中换出冷量子
+	struct crypto_comp *zip_tfm;	// 压缩器, 第一次开启压缩时申请
+	struct semaphore zip_sem;	// 保护zip_tfm的使用, 压缩可能很慢, 不用自旋锁
+	unsigned int zip_idle;		// 压缩周期(秒), 0为不压缩
+	atomic_long_t zip_bytes;	// 压缩后的字节数
+	atomic_long_t zip_orig;		// 被压缩的量子压缩前的字节数
+	struct work_struct zip_work;	// 在scull_wq中周期性地压缩冷量子
+	struct scull_pool pool;		// 空闲量子池
+	struct scull_cpu_stats *stats;	// 按CPU的统计信息, 申请失败时为NULL
 	unsigned int access_key;	// 供sculluid 和 scullpriv使用
-	struct semaphore sem;		// 信号量
+	struct semaphore sem;		// 设备级信号量, 只用于结构性修改(扩展索引, 创建量子集, trim)
 	struct cdev cdev;			// 字符设备结构(内核使用)
 };
 
+// 日志模式下已写完但还不能提交的预留范围, 见scull_dev_append
+struct scull_log_range {
+	struct scull_log_range *next;
+	unsigned long start, end;
+};
+
+// 定位量子集时记录的几何参数, 见scull_get_qset
+struct scull_geom {
+	int quantum, qset;
+	long itemsize;
+	long rest;					// pos在量子集内的偏移
+	unsigned long gen;			// 定位时设备的代号
+};
+
+/**
+ * 把位置pos分成项号(返回值)和项内的偏移*rest
+ * 32位内核上loff_t的除法要用do_div; 强制转换为long会使2GB以上的位置变成
+ * 负数, 越过项号的上界检查. 超出int的项号截为INT_MAX, 返回值不会小于0
+ */
+static inline int scull_split_pos(loff_t pos, long itemsize, long *rest)
+{
+	u64 n = pos;
+
+#if BITS_PER_LONG == 64
+	*rest = n % itemsize;
+	n /= itemsize;
+#else
+	*rest = do_div(n, itemsize);
+#endif
+	return n > INT_MAX ? INT_MAX : n;
+}
+
+// 稀疏文件定位, 老的头文件中没有定义; 本内核的sys_lseek不接受, 见SCULL_IOCSEEK
+#ifndef SEEK_DATA
+#define SEEK_DATA	3	// 下一个数据区
+#define SEEK_HOLE	4	// 下一个空洞
+#endif
+
+// 设备的次设备号, 用于统计和跟踪点
+#define SCULL_MINOR(dev)	MINOR((dev)->cdev.dev)
+
 // 将 minors 分为两部分
 #define TYPE(minor)	((minor) >> 4) & 0xf)	// 高4位
 #define NUM(minor)	((minor) & 0xf)			// 底4位
@@ -87,29 +389,169 @@ struct scull_dev {
  *  不同设备使用的配置参数
  */
 // main.c
+extern struct scull_dev *scull_devices;
+extern struct workqueue_struct *scull_wq;
+extern struct file_operations scull_fops;
+extern struct file_operations scull_pipe_fops;
 extern int scull_major;
 extern int scull_nr_devs;
 extern int scull_quantum;
 extern int scull_qset;
 // pipe.c
 extern int scull_p_buffer;
+// pool.c
+extern int scull_pool_min;
+extern int scull_pool_max;
+extern int scull_pool_bytes;
 
 // 函数原型
+struct scull_geometry;
+
+// engine.c, 存储引擎, 也可以在用户空间编译
+void scull_dev_init(struct scull_dev *dev);
+void scull_dev_cleanup(struct scull_dev *dev);
+int scull_trim(struct scull_dev *dev);
+void scull_get_geometry(struct scull_dev *dev, struct scull_geometry *geo);
+int scull_set_geometry(struct scull_dev *dev, const struct scull_geometry *geo);
+char *scull_lookup(struct scull_index *idx, loff_t pos, int *q_pos);
+ssize_t scull_dev_readv(struct scull_dev *dev, const struct iovec *iov,
+					unsigned long nr_segs, loff_t *f_pos);
+ssize_t scull_dev_writev(struct scull_dev *dev, const struct iovec *iov,
+					unsigned long nr_segs, loff_t *f_pos);
+int scull_prealloc(struct scull_dev *dev, loff_t offset, loff_t len, int mode);
+int scull_punch_hole(struct scull_dev *dev, loff_t offset, loff_t len);
+loff_t scull_seek_data_hole(struct scull_dev *dev, loff_t off, int whence);
+struct scull_qset *scull_get_qset(struct scull_dev *dev, loff_t pos,
+					int create, struct scull_geom *g);
+void scull_mem_usage(struct scull_dev *dev, struct scull_mem *mem);
+int scull_unshare(struct scull_dev *dev);
+int scull_snapshot(struct scull_dev *src, struct scull_dev *dst);
+ssize_t scull_copy_range(struct scull_dev *src, loff_t off_in,
+					struct scull_dev *dst, loff_t off_out, size_t len,
+					int flags);
+ssize_t scull_dev_append(struct scull_dev *dev, const struct iovec *iov,
+					unsigned long nr_segs, loff_t *f_pos);
+int scull_set_log(struct scull_dev *dev, int on);
+
+// cow.c
+int scull_share_get(void *q);
+int scull_quantum_shared(void *q);
+int scull_qset_quantum_shared(struct scull_qset *dptr, int qset, int j);
+void scull_quantum_release(struct scull_dev *dev, void *q, int quantum);
+void *scull_cow(struct scull_dev *dev, struct scull_qset *dptr, int s_pos,
+				int quantum);
+
+// pool.c
+void scull_pool_init(struct scull_pool *pool);
+void *scull_pool_get_quantum(struct scull_pool *pool, int quantum);
+void scull_pool_put_quantum(struct scull_pool *pool, void *q, int quantum);
+void scull_pool_drain(struct scull_pool *pool);
+int scull_quantum_paged(int quantum);
+struct scull_qset *scull_qset_alloc(int qset);
+void scull_qset_free(struct scull_qset *qs, int qset);
+size_t scull_qset_bytes(int qset);
+void scull_qset_caches_destroy(void);
+
+// tier.c
+struct scull_tier_batch;
+extern char *scull_swap;
+extern int scull_mem_cap;
+void scull_tier_init(struct scull_dev *dev);
+int scull_tier_setup(struct scull_dev *dev, int index);
+void scull_tier_stop(struct scull_dev *dev);
+void scull_tier_release(struct scull_dev *dev);
+int scull_set_mem_cap(struct scull_dev *dev, unsigned long cap);
+void *scull_tier_load(struct scull_dev *dev, struct scull_qset *dptr, int s_pos,
+				loff_t base, int quantum, int qset);
+int scull_tier_fault(struct scull_dev *dev, loff_t pos);
+ssize_t scull_tier_read(struct scull_dev *dev, void *buf, loff_t base,
+				int quantum);
+ssize_t scull_file_io(struct file *filp, void *buf, size_t len, loff_t pos,
+				int write);
+struct scull_tier_batch *scull_tier_batch_alloc(struct scull_dev *dev, int quantum);
+int scull_tier_batch_add(struct scull_tier_batch *batch, void *q);
+void scull_tier_batch_done(struct scull_tier_batch *batch);
+
+// zip.c
+struct crypto_comp;
+extern char *scull_zip_alg;
+extern int scull_zip_idle;
+void scull_zip_init(struct scull_dev *dev);
+int scull_set_zip(struct scull_dev *dev, unsigned int idle);
+void scull_zip_stop(struct scull_dev *dev);
+void scull_zip_release(struct scull_dev *dev);
+int scull_zip_sweep(struct scull_dev *dev);
+int scull_unzip(struct scull_dev *dev, void *q, void *buf, int quantum);
+void scull_zip_free(struct scull_dev *dev, void *q, int quantum);
+
+#ifdef __KERNEL__
 int scull_p_init(dev_t dev);
 void scull_p_cleanup(void);
 int scull_access_init(dev_t dev);
 void scull_access_cleanup(void);
 
 int scull_strim(struct scull_dev *dev);
+// stats.c
+u64 scull_now(void);
+void scull_stats_init(struct scull_dev *dev);
+void scull_stats_free(struct scull_dev *dev);
+void scull_stat_op(struct scull_dev *dev, int op, size_t want, ssize_t done,
+					u64 ns);
+void scull_stat_sem_wait(struct scull_dev *dev, u64 start);
+void scull_stat_alloc_fail(struct scull_dev *dev);
+void scull_stat_zero_dedup(struct scull_dev *dev);
+void scull_stat_cow(struct scull_dev *dev);
+void scull_stat_tier(struct scull_dev *dev, int event);
+void scull_stats_create_proc(void);
+void scull_stats_remove_proc(void);
+// checkpoint.c
+extern char *scull_backing;
+extern int scull_restore;
+extern int scull_ckpt_unload;
+int scull_checkpoint(struct scull_dev *dev, int mode);
+int scull_ckpt_restore(struct scull_dev *dev);
 
+// main.c, mmap.c
 ssize_t scull_read(struct file *filp, char __user *buf, size_t count,
 					loff_t *f_pos);
 ssize_t scull_write(struct file *filp, const char __user *buf, size_t count,
 					loff_t *fops);
+ssize_t scull_readv(struct file *filp, const struct iovec *iov,
+					unsigned long nr_segs, loff_t *f_pos);
+ssize_t scull_writev(struct file *filp, const struct iovec *iov,
+					unsigned long nr_segs, loff_t *f_pos);
+ssize_t scull_sendfile(struct file *filp, loff_t *ppos, size_t count,
+					read_actor_t actor, void *target);
+ssize_t scull_sendpage(struct file *filp, struct page *page, int offset,
+					size_t size, loff_t *ppos, int more);
 loff_t scull_llseek(struct file *filp, loff_t off, int whence);
+int scull_mmap(struct file *filp, struct vm_area_struct *vma);
+struct page *scull_quantum_page(const void *addr);
 int scull_ioctl(struct inode *inode, struct file *filp, unsigned int cmd,
 				unsigned long arg);
-int scull_trim(struct scull_dev *dev);
+#endif /* __KERNEL__ */
+
+// 驻留的量子超过上限时在后台换出
+static inline void scull_tier_check(struct scull_dev *dev)
+{
+	if (dev->mem_cap && atomic_long_read(&dev->pool.in_use) -
+			atomic_long_read(&dev->tier_pending) > (long)dev->mem_cap)
+		queue_work(scull_wq, &dev->tier_work);
+}
+
+// 访问驻留的量子: 设置CLOCK引用位, 已置位时不写, 避免读者之间争用缓存行
+static inline void scull_tier_touch(struct scull_dev *dev, struct scull_qset *qs,
+				int s_pos, int qset)
+{
+	unsigned long *ref;
+
+	if (!dev->mem_cap && !dev->zip_idle)
+		return;
+	ref = scull_qset_ref(qs, qset);
+	if (!test_bit(s_pos, ref))
+		set_bit(s_pos, ref);
+	scull_stat_tier(dev, SCULL_TIER_HIT);
+}
 
 /**
  *  ioctl 相关定义
@@ -147,9 +589,109 @@ int scull_trim(struct scull_dev *dev);
  */
 #define SCULL_P_IOCTSIZE	_IO(SCULL_IOC_MAGIC, 13)
 #define SCULL_P_IOCQSIZE	_IO(SCULL_IOC_MAGIC, 14)
+
+/**
+ * 预分配一段范围内的量子, 或者释放一段范围(打洞)
+ * 本内核的file_operations没有fallocate, 以ioctl提供
+ */
+struct scull_falloc {
+	long long offset;			// 起始位置
+	long long len;				// 长度
+	int mode;					// SCULL_FALLOC_* 的组合
+};
+
+#define SCULL_FALLOC_KEEP_SIZE	0x01	// 预分配时不扩展设备大小
+#define SCULL_FALLOC_PUNCH_HOLE	0x02	// 释放范围内的量子, 不改变大小
+#define SCULL_FALLOC_ZERO		0x04	// 预分配时把已有数据清零
+
+#define SCULL_IOCFALLOC		_IOW(SCULL_IOC_MAGIC, 15, struct scull_falloc)
+
+/**
+ * 单个设备的几何参数, 与上面修改全局参数的命令不同, 立即生效:
+ * 已有的数据在后台按新参数重整, 期间读者不受影响
+ * 设置时quantum或qset为0表示保持不变
+ */
+struct scull_geometry {
+	int quantum;
+	int qset;
+	int flags;					// SCULL_GEOM_* 的组合
+};
+
+#define SCULL_GEOM_AUTO			0x01	// 根据写入大小自动选择
+#define SCULL_GEOM_RESHAPING	0x02	// 只读: 重整尚未完成
+
+#define SCULL_IOCSGEOM		_IOW(SCULL_IOC_MAGIC, 16, struct scull_geometry)
+#define SCULL_IOCGGEOM		_IOR(SCULL_IOC_MAGIC, 17, struct scull_geometry)
+
+/**
+ * 把本设备的快照建立到次设备号为arg的scull设备上, 目标原有的数据被清空
+ * 两者共享量子, 写入时才复制; 任一方被映射时返回EBUSY
+ */
+#define SCULL_IOCSNAP		_IO(SCULL_IOC_MAGIC, 18)
+
+/**
+ * 把设备的内容写入备份文件(模块参数scull_backing加上设备号), arg为模式
+ * 增量模式只重写上次检查点以来被修改过的量子; 设备被trim或重整过时
+ * 自动改为完整模式
+ */
+#define SCULL_CKPT_FULL			0
+#define SCULL_CKPT_INCREMENTAL	1
+
+#define SCULL_IOCCKPT		_IO(SCULL_IOC_MAGIC, 19)
+
+/**
+ * arg非0时进入日志模式: 只接受O_APPEND的写入, 并发的追加各自预留范围后
+ * 并行复制, 按顺序提交; 读者只读到已提交的数据, poll在水位推进时返回可读
+ * arg为0时退出, 有追加正在进行时返回EBUSY
+ */
+#define SCULL_IOCLOG		_IO(SCULL_IOC_MAGIC, 20)
+
+/**
+ * 设置驻留内存的量子上限, arg以KB为单位, 0为不限制; 超过上限时最久未被
+ * 访问的量子被换出到交换文件(模块参数scull_swap加上设备号), 访问时调入
+ * 没有交换文件时返回ENODEV
+ */
+#define SCULL_IOCMEMCAP		_IO(SCULL_IOC_MAGIC, 21)
+
+/**
+ * 压缩arg秒内没有被访问的量子, 0为停止压缩, 已压缩的量子在访问时解压
+ * 内核没有可用的压缩器时返回错误
+ */
+#define SCULL_IOCZIP		_IO(SCULL_IOC_MAGIC, 22)
+
+/**
+ * 把fd_in(另一个scull设备, 或者本设备)中从off_in开始的len字节复制到
+ * 本设备的off_out处, 数据不经过用户空间; 返回时len为实际复制的字节数
+ * 本内核没有copy_file_range, 以ioctl提供
+ * SCULL_COPY_REFLINK时两个偏移必须按量子对齐, 完整的量子被两个设备共享,
+ * 写入时才复制; 任一方被映射时返回EBUSY
+ */
+struct scull_copy {
+	int fd_in;					// 源设备的文件描述符, 必须可读
+	int flags;					// SCULL_COPY_* 的组合
+	long long off_in;
+	long long off_out;
+	long long len;
+};
+
+#define SCULL_COPY_REFLINK		0x01	// 共享完整的量子而不是复制
+
+#define SCULL_IOCCOPY		_IOWR(SCULL_IOC_MAGIC, 23, struct scull_copy)
+
+/**
+ * 从offset开始查找下一个数据区(whence为SEEK_DATA, 即3)或空洞(SEEK_HOLE, 即4)
+ * 本内核的sys_lseek拒绝大于SEEK_END的whence, 以ioctl提供; 成功时与lseek一样
+ * 移动文件位置, offset为新的位置. offset不小于设备大小时返回ENXIO
+ */
+struct scull_seek {
+	long long offset;
+	int whence;
+};
+
+#define SCULL_IOCSEEK		_IOWR(SCULL_IOC_MAGIC, 24, struct scull_seek)
 /* 更多命令略 */
 
 // 最大顺序标号
-#define SCULL_IOC_MAXNR	14
+#define SCULL_IOC_MAXNR	24
 
 #endif /* _SCULL_H_ */
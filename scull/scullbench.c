@@ -0,0 +1,521 @@
+/*
+ * scullbench.c -- scull系列设备的吞吐量和延迟测试
+ *
+ * 用法: scullbench [-M 模式] [-d 设备] [-o 输出设备] [-b 块大小列表] [-t 线程数列表]
+ *                  [-p 访问模式] [-S 步长] [-r 读比例] [-m 区域MB数] [-s 秒数]
+ *                  [-l 标签] [-j] [-H] [-P]
+ *   -M  rw(默认): 按读比例混合读写; read: 只读, 默认随机访问, 用于观察
+ *       吞吐量随读者线程数的变化; sendfile: 见下
+ *   -d  /dev/scull0, /dev/scullpipe0, /dev/scullc0, /dev/sculld0 等
+ *   -b  逗号分隔的块大小, 如 512,4096,65536
+ *   -t  逗号分隔的线程数, 如 1,2,4,8
+ *   -p  seq(顺序), rand(随机) 或 stride(每次跳过 -S 字节)
+ *   -r  读操作所占的百分比, 100为只读, 0为只写
+ *   -l  写入每行结果的标签(如模块的版本), 便于比较不同的构建
+ *   -j  以JSON(每行一个对象)输出, 默认输出CSV
+ *   -H  CSV输出时不打印表头
+ *   -P  只打印CSV表头后退出
+ * 对可定位的设备, 先填充 -m MB 的数据, 之后每个线程在这一区域内
+ * 以pread/pwrite访问; pipe设备忽略访问模式, 按读比例把线程分为读者和写者
+ * 每种块大小和线程数的组合输出一行: 吞吐量, 每秒操作数, p50/p99/p999
+ * 延迟(微秒), 以及每MB数据消耗的CPU时间(微秒)
+ * sendfile模式对每种块大小分别用read()+write()循环和sendfile()把 -m MB
+ * 的数据从设备搬到输出端, 各输出一行(访问模式一列为readwrite或sendfile);
+ * 不指定 -o 时输出到一个socketpair, 由另一个线程读出并丢弃, 指定时输出到
+ * 另一个scull设备(使用其sendpage). 输入为scullpipe时需要另有进程持续写入
+ * 编译: make scullbench
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sched.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+
+#define MAX_LIST    32
+
+/**
+ * 延迟直方图: 以2的幂分组, 每组再线性分为SUB_BUCKETS个桶
+ * 相对误差不超过1/SUB_BUCKETS, 不需要保存每个样本
+ */
+#define SUB_BITS    4
+#define SUB_BUCKETS (1 << SUB_BITS)
+#define NR_BUCKETS  (64 * SUB_BUCKETS)
+
+enum { PAT_SEQ, PAT_RAND, PAT_STRIDE };
+enum { MODE_RW, MODE_READ, MODE_SENDFILE };
+
+static int mode = MODE_RW;
+static const char *device = "/dev/scull0";
+static const char *output;
+static size_t blksizes[MAX_LIST] = { 4096 };
+static int nr_blksizes = 1;
+static int threads[MAX_LIST] = { 1 };
+static int nr_threads = 1;
+static int pattern = -1;     // 未指定时rw模式顺序访问, read模式随机访问
+static size_t stride = 1 << 20;
+static int read_pct = 100;
+static size_t region_mb = 64;
+static int seconds = 3;
+static const char *label = "-";
+static int json, no_header;
+static int is_pipe;
+
+static volatile int stop;
+
+struct worker {
+    pthread_t tid;
+    int index;
+    int reader;             // pipe设备: 固定为读者或写者
+    size_t blksize;
+    unsigned int seed;
+    unsigned long long ops, bytes, errors;
+    unsigned long hist[NR_BUCKETS];
+};
+
+static const char *pattern_names[] = { "seq", "rand", "stride" };
+
+static unsigned long long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static double cpu_seconds(void)
+{
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+            ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+// 延迟所在的桶
+static int bucket_of(unsigned long long ns)
+{
+    int shift = 0;
+
+    if (ns < SUB_BUCKETS)
+        return ns;
+    shift = 63 - __builtin_clzll(ns) - SUB_BITS;
+    return (shift + 1) * SUB_BUCKETS + (int)((ns >> shift) - SUB_BUCKETS);
+}
+
+// 桶的下限(纳秒), bucket_of的逆运算
+static unsigned long long bucket_floor(int b)
+{
+    int shift = b / SUB_BUCKETS - 1;
+
+    if (shift < 0)
+        return b;
+    return (unsigned long long)(SUB_BUCKETS + b % SUB_BUCKETS) << shift;
+}
+
+// 求百分位数(0 < p < 1), 返回微秒
+static double percentile(const unsigned long *hist, unsigned long long total,
+                        double p)
+{
+    unsigned long long want = (unsigned long long)(total * p), seen = 0;
+    int b;
+
+    for (b = 0; b < NR_BUCKETS; b++) {
+        seen += hist[b];
+        if (seen > want)
+            return bucket_floor(b) / 1e3;
+    }
+    return 0;
+}
+
+// 解析逗号分隔的列表, 支持k/m后缀
+static int parse_list(const char *arg, size_t *out)
+{
+    char *copy = strdup(arg), *tok, *end, *save;
+    int n = 0;
+
+    for (tok = strtok_r(copy, ",", &save); tok && n < MAX_LIST;
+            tok = strtok_r(NULL, ",", &save)) {
+        out[n] = strtoul(tok, &end, 0);
+        if (*end == 'k' || *end == 'K')
+            out[n] <<= 10;
+        else if (*end == 'm' || *end == 'M')
+            out[n] <<= 20;
+        if (out[n])
+            n++;
+    }
+    free(copy);
+    return n;
+}
+
+// 填充可定位的设备, 只写打开会先清空设备
+static int fill(void)
+{
+    size_t total = region_mb << 20, done = 0, chunk = 1 << 20;
+    char *buf;
+    ssize_t ret;
+    int fd;
+
+    fd = open(device, O_WRONLY);
+    if (fd < 0) {
+        perror(device);
+        return -1;
+    }
+    buf = malloc(chunk);
+    memset(buf, 'x', chunk);
+    while (done < total) {
+        ret = write(fd, buf, chunk);
+        if (ret <= 0) {
+            perror("write");
+            break;
+        }
+        done += ret;
+    }
+    free(buf);
+    close(fd);
+    return done == total ? 0 : -1;
+}
+
+// 下一次访问的偏移, 保持块对齐并落在填充区域内
+static off_t next_offset(struct worker *w, off_t *cursor)
+{
+    size_t nblocks = (region_mb << 20) / w->blksize;
+    off_t off;
+
+    switch (pattern) {
+    case PAT_RAND:
+        return (off_t)(rand_r(&w->seed) % nblocks) * w->blksize;
+    case PAT_STRIDE:
+        off = *cursor;
+        *cursor += stride;
+        if (*cursor + w->blksize > (region_mb << 20))
+            *cursor = (*cursor + w->blksize) % stride;  // 绕回, 错开一块
+        return off;
+    default:
+        off = *cursor;
+        *cursor += w->blksize;
+        if (*cursor + w->blksize > (region_mb << 20))
+            *cursor = 0;
+        return off;
+    }
+}
+
+static void *worker_thread(void *arg)
+{
+    struct worker *w = arg;
+    size_t region = region_mb << 20;
+    char *buf = malloc(w->blksize);
+    off_t cursor, off;
+    unsigned long long t0, t1;
+    ssize_t ret;
+    int fd, reading;
+
+    memset(buf, 'y', w->blksize);
+    fd = open(device, is_pipe ? (w->reader ? O_RDONLY : O_WRONLY) | O_NONBLOCK
+                            : O_RDWR);
+    if (fd < 0) {
+        perror(device);
+        free(buf);
+        return NULL;
+    }
+    // 各线程从区域内不同的位置开始, 避免顺序访问时互相重叠
+    cursor = is_pipe ? 0 : ((off_t)w->index * (region / 8)) % region;
+    cursor -= cursor % w->blksize;
+
+    while (!stop) {
+        if (is_pipe)
+            reading = w->reader;
+        else
+            reading = (int)(rand_r(&w->seed) % 100) < read_pct;
+
+        t0 = now_ns();
+        if (is_pipe) {
+            ret = reading ? read(fd, buf, w->blksize)
+                            : write(fd, buf, w->blksize);
+        } else {
+            off = next_offset(w, &cursor);
+            ret = reading ? pread(fd, buf, w->blksize, off)
+                            : pwrite(fd, buf, w->blksize, off);
+        }
+        t1 = now_ns();
+
+        if (ret < 0 && (errno == EAGAIN || errno == EINTR)) {
+            sched_yield();  // pipe空或满, 不计入统计
+            continue;
+        }
+        if (ret <= 0) {
+            w->errors++;
+            if (w->errors > 1000)
+                break;
+            continue;
+        }
+        w->ops++;
+        w->bytes += ret;
+        w->hist[bucket_of(t1 - t0)]++;
+    }
+    close(fd);
+    free(buf);
+    return NULL;
+}
+
+static void print_header(void)
+{
+    printf("label,device,pattern,read_pct,blksize,threads,seconds,ops,"
+            "bytes,errors,mb_per_s,iops,p50_us,p99_us,p999_us,cpu_s,"
+            "cpu_us_per_mb\n");
+}
+
+static void report(const char *pat, size_t blksize, int nthreads,
+                    struct worker *sum, double elapsed, double cpu)
+{
+    double mbps = sum->bytes / elapsed / (1 << 20);
+    double iops = sum->ops / elapsed;
+    double p50 = percentile(sum->hist, sum->ops, 0.50);
+    double p99 = percentile(sum->hist, sum->ops, 0.99);
+    double p999 = percentile(sum->hist, sum->ops, 0.999);
+    double cpu_us_per_mb = sum->bytes ? cpu * 1e6 / (sum->bytes / (double)(1 << 20)) : 0;
+
+    if (json) {
+        printf("{\"label\":\"%s\",\"device\":\"%s\",\"pattern\":\"%s\","
+                "\"read_pct\":%d,\"blksize\":%zu,\"threads\":%d,"
+                "\"seconds\":%.3f,\"ops\":%llu,\"bytes\":%llu,\"errors\":%llu,"
+                "\"mb_per_s\":%.2f,\"iops\":%.0f,\"p50_us\":%.2f,"
+                "\"p99_us\":%.2f,\"p999_us\":%.2f,\"cpu_s\":%.3f,"
+                "\"cpu_us_per_mb\":%.1f}\n",
+                label, device, pat, read_pct, blksize, nthreads, elapsed,
+                sum->ops, sum->bytes, sum->errors, mbps, iops, p50, p99, p999,
+                cpu, cpu_us_per_mb);
+    } else {
+        printf("%s,%s,%s,%d,%zu,%d,%.3f,%llu,%llu,%llu,%.2f,%.0f,%.2f,%.2f,"
+                "%.2f,%.3f,%.1f\n",
+                label, device, pat, read_pct, blksize, nthreads, elapsed,
+                sum->ops, sum->bytes, sum->errors, mbps, iops, p50, p99, p999,
+                cpu, cpu_us_per_mb);
+    }
+    fflush(stdout);
+}
+
+static void run(size_t blksize, int nthreads)
+{
+    struct worker *workers = calloc(nthreads, sizeof(*workers));
+    struct worker *sum = calloc(1, sizeof(*sum));
+    int i, b, nreaders;
+    double start, elapsed, cpu;
+
+    // pipe设备: 按读比例分配读者, 读写都有时两边至少各一个线程
+    nreaders = (nthreads * read_pct + 50) / 100;
+    if (read_pct > 0 && read_pct < 100 && nthreads > 1) {
+        if (nreaders == 0)
+            nreaders = 1;
+        if (nreaders == nthreads)
+            nreaders = nthreads - 1;
+    }
+
+    stop = 0;
+    cpu = cpu_seconds();
+    start = now_ns() / 1e9;
+    for (i = 0; i < nthreads; i++) {
+        workers[i].index = i;
+        workers[i].reader = i < nreaders;
+        workers[i].blksize = blksize;
+        workers[i].seed = i + 1;
+        pthread_create(&workers[i].tid, NULL, worker_thread, &workers[i]);
+    }
+    sleep(seconds);
+    stop = 1;
+    for (i = 0; i < nthreads; i++) {
+        pthread_join(workers[i].tid, NULL);
+        sum->ops += workers[i].ops;
+        sum->bytes += workers[i].bytes;
+        sum->errors += workers[i].errors;
+        for (b = 0; b < NR_BUCKETS; b++)
+            sum->hist[b] += workers[i].hist[b];
+    }
+    elapsed = now_ns() / 1e9 - start;
+    cpu = cpu_seconds() - cpu;
+
+    report(is_pipe ? "pipe" : pattern_names[pattern], blksize, nthreads, sum,
+            elapsed, cpu);
+    free(workers);
+    free(sum);
+}
+
+// socketpair另一端的读取线程, 丢弃所有数据
+static void *drain_thread(void *arg)
+{
+    int fd = *(int *)arg;
+    char buf[65536];
+
+    while (read(fd, buf, sizeof(buf)) > 0)
+        ;
+    return NULL;
+}
+
+// 打开sendfile模式的输出端, 返回写入用的fd, 以及需要回收的读取线程
+static int open_output(pthread_t *tid, int *peer)
+{
+    int sv[2];
+
+    if (output)
+        return open(output, O_WRONLY);
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+        perror("socketpair");
+        return -1;
+    }
+    *peer = sv[1];
+    pthread_create(tid, NULL, drain_thread, peer);
+    return sv[0];
+}
+
+static void close_output(int fd, pthread_t tid, int peer)
+{
+    close(fd);
+    if (!output) {
+        pthread_join(tid, NULL);
+        close(peer);
+    }
+}
+
+// 把区域内的数据从设备搬到输出端, 每次调用计一次操作
+static void run_copy(size_t blksize, int use_sendfile)
+{
+    struct worker *sum = calloc(1, sizeof(*sum));
+    size_t total = region_mb << 20;
+    char *buf = malloc(blksize);
+    unsigned long long t0, t1;
+    double start, elapsed, cpu;
+    pthread_t tid;
+    int in, out, peer = -1;
+    ssize_t ret;
+
+    in = open(device, O_RDONLY);
+    out = open_output(&tid, &peer);
+    if (in < 0 || out < 0) {
+        perror("open");
+        exit(1);
+    }
+
+    cpu = cpu_seconds();
+    start = now_ns() / 1e9;
+    while (sum->bytes < total) {
+        t0 = now_ns();
+        if (use_sendfile) {
+            ret = sendfile(out, in, NULL, blksize);
+        } else {
+            ret = read(in, buf, blksize);
+            if (ret > 0)
+                ret = write(out, buf, ret);
+        }
+        t1 = now_ns();
+        if (ret <= 0) {
+            if (ret < 0)
+                sum->errors++;
+            break;
+        }
+        sum->ops++;
+        sum->bytes += ret;
+        sum->hist[bucket_of(t1 - t0)]++;
+    }
+    elapsed = now_ns() / 1e9 - start;
+    cpu = cpu_seconds() - cpu;
+
+    close(in);
+    close_output(out, tid, peer);
+    report(use_sendfile ? "sendfile" : "readwrite", blksize, 1, sum, elapsed, cpu);
+    free(buf);
+    free(sum);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-M rw|read|sendfile] [-d dev] [-o output] "
+            "[-b blksizes] [-t threads] [-p seq|rand|stride] [-S stride] "
+            "[-r read_pct] [-m region_mb] [-s seconds] [-l label] [-j] [-H] "
+            "[-P]\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+    size_t list[MAX_LIST];
+    int opt, i, j, n;
+
+    while ((opt = getopt(argc, argv, "M:d:o:b:t:p:S:r:m:s:l:jHP")) != -1) {
+        switch (opt) {
+        case 'M':
+            if (!strcmp(optarg, "read"))
+                mode = MODE_READ;
+            else if (!strcmp(optarg, "sendfile"))
+                mode = MODE_SENDFILE;
+            else
+                mode = MODE_RW;
+            break;
+        case 'd': device = optarg; break;
+        case 'o': output = optarg; break;
+        case 'b': nr_blksizes = parse_list(optarg, blksizes); break;
+        case 't':
+            n = parse_list(optarg, list);
+            for (i = 0; i < n; i++)
+                threads[i] = list[i];
+            nr_threads = n;
+            break;
+        case 'p':
+            if (!strcmp(optarg, "rand"))
+                pattern = PAT_RAND;
+            else if (!strcmp(optarg, "stride"))
+                pattern = PAT_STRIDE;
+            else
+                pattern = PAT_SEQ;
+            break;
+        case 'S': parse_list(optarg, &stride); break;
+        case 'r': read_pct = atoi(optarg); break;
+        case 'm': region_mb = strtoul(optarg, NULL, 0); break;
+        case 's': seconds = atoi(optarg); break;
+        case 'l': label = optarg; break;
+        case 'j': json = 1; break;
+        case 'H': no_header = 1; break;
+        case 'P':
+            print_header();
+            return 0;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (!nr_blksizes || !nr_threads || read_pct < 0 || read_pct > 100 ||
+            !stride) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (mode == MODE_READ)
+        read_pct = 100;
+    if (pattern < 0)
+        pattern = mode == MODE_READ ? PAT_RAND : PAT_SEQ;
+    is_pipe = strstr(device, "pipe") != NULL;
+    for (i = 0; i < nr_blksizes; i++) {
+        if (!is_pipe && (region_mb << 20) < blksizes[i]) {
+            fprintf(stderr, "region must hold at least one block\n");
+            return 1;
+        }
+    }
+
+    if (!is_pipe && fill())
+        return 1;
+    if (!json && !no_header)
+        print_header();
+    for (i = 0; i < nr_blksizes; i++) {
+        if (mode == MODE_SENDFILE) {
+            run_copy(blksizes[i], 0);
+            run_copy(blksizes[i], 1);
+            continue;
+        }
+        for (j = 0; j < nr_threads; j++)
+            run(blksizes[i], threads[j]);
+    }
+    return 0;
+}
@@ -0,0 +1,96 @@
+#!/bin/sh
+# scullbench.sh -- 对已加载的scull系列设备运行一组固定的测试
+#
+# 用法: scullbench.sh run 标签 [结果文件]
+#       scullbench.sh compare 旧结果 新结果 [允许的下降百分比]
+# run: 对存在的 /dev/scull0, /dev/scullpipe0, /dev/scullc0, /dev/sculld0
+#      依次测试不同的块大小, 线程数, 访问模式和读写比例, 以及read()+write()
+#      与sendfile()的对比, 结果以CSV
+#      追加到结果文件(默认 scullbench-标签.csv)
+# compare: 按相同的测试条件对比两个结果文件, 吞吐量下降或p99延迟上升
+#      超过阈值(默认10%)时标记为REGRESSION, 存在回归时以1退出
+# 环境变量 BENCH, BLKSIZES, THREADS, DURATION, REGION_MB 可以覆盖默认参数
+
+bench=${BENCH:-./scullbench}
+blksizes=${BLKSIZES:-512,4096,65536}
+threads=${THREADS:-1,2,4,8}
+seconds=${DURATION:-2}
+region=${REGION_MB:-64}
+
+run() {
+    label=$1
+    out=${2:-scullbench-$label.csv}
+
+    [ -x "$bench" ] || { echo "$bench not found, build it with:" \
+        "make scullbench" >&2; exit 1; }
+    [ -f "$out" ] || $bench -P > "$out"
+
+    for dev in /dev/scull0 /dev/scullc0 /dev/sculld0; do
+        [ -c $dev ] || continue
+        for pat in seq rand stride; do
+            for mix in 100 70 0; do
+                $bench -H -d $dev -l "$label" -b $blksizes -t $threads \
+                    -p $pat -r $mix -m $region -s $seconds >> "$out"
+            done
+        done
+    done
+
+    # read()+write()循环与sendfile()搬运数据的对比
+    for dev in /dev/scull0 /dev/scullc0 /dev/sculld0; do
+        [ -c $dev ] || continue
+        $bench -H -M sendfile -d $dev -l "$label" -b $blksizes -m $region \
+            >> "$out"
+    done
+
+    # pipe设备只有读写比例有意义, 需要同时有读者和写者
+    dev=/dev/scullpipe0
+    if [ -c $dev ]; then
+        $bench -H -d $dev -l "$label" -b $blksizes -t 2,4,8 -r 50 \
+            -s $seconds >> "$out"
+    fi
+    echo "results in $out"
+}
+
+# 以device, pattern, read_pct, blksize, threads为键对比两个文件
+compare() {
+    old=$1
+    new=$2
+    limit=${3:-10}
+
+    awk -F, -v limit="$limit" '
+    FNR == 1 { next }
+    {
+        key = $2 "," $3 "," $4 "," $5 "," $6
+        if (FILENAME == ARGV[1]) {
+            mbps[key] = $11; p99[key] = $14
+            next
+        }
+        if (!(key in mbps) || mbps[key] == 0)
+            next
+        dt = ($11 - mbps[key]) * 100 / mbps[key]
+        dl = p99[key] > 0 ? ($14 - p99[key]) * 100 / p99[key] : 0
+        flag = (dt < -limit || dl > limit) ? "REGRESSION" : "ok"
+        if (flag != "ok")
+            bad++
+        printf "%-40s %10.1f -> %10.1f MB/s (%+6.1f%%)  p99 %8.2f -> %8.2f us (%+6.1f%%)  %s\n",
+            key, mbps[key], $11, dt, p99[key], $14, dl, flag
+    }
+    END { exit bad ? 1 : 0 }' "$old" "$new"
+}
+
+case "$1" in
+    run)
+        shift
+        [ -n "$1" ] || { echo "usage: $0 run label [output]" >&2; exit 1; }
+        run "$@"
+        ;;
+    compare)
+        shift
+        [ $# -ge 2 ] || { echo "usage: $0 compare old.csv new.csv [pct]" >&2; exit 1; }
+        compare "$@"
+        ;;
+    *)
+        echo "usage: $0 run label [output] | compare old.csv new.csv [pct]" >&2
+        exit 1
+        ;;
+esac
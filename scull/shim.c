@@ -0,0 +1,138 @@
+/*
+ * shim.c -- shim.h在用户空间的实现部分, 只用于用户空间的编译
+ * 内核模块不包含本文件
+ */
+
+#include "shim.h"
+#include <zlib.h>
+
+char scull_zero_page[PAGE_SIZE];
+
+// 挂起的RCU回调, 按提交的顺序执行
+static struct rcu_head *rcu_pending, **rcu_tail = &rcu_pending;
+static pthread_mutex_t rcu_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void call_rcu(struct rcu_head *head, void (*func)(struct rcu_head *head))
+{
+    head->func = func;
+    head->next = NULL;
+    pthread_mutex_lock(&rcu_lock);
+    *rcu_tail = head;
+    rcu_tail = &head->next;
+    pthread_mutex_unlock(&rcu_lock);
+}
+
+// 调用者保证此时没有读者, 执行所有挂起的回调(回调中可能再提交新的回调)
+void rcu_barrier(void)
+{
+    struct rcu_head *head, *next;
+
+    for (;;) {
+        pthread_mutex_lock(&rcu_lock);
+        head = rcu_pending;
+        rcu_pending = NULL;
+        rcu_tail = &rcu_pending;
+        pthread_mutex_unlock(&rcu_lock);
+        if (!head)
+            break;
+        for (; head; head = next) {
+            next = head->next;
+            head->func(head);
+        }
+    }
+}
+
+struct file *filp_open(const char *name, int flags, int mode)
+{
+    struct file *filp = malloc(sizeof(struct file));
+
+    if (!filp)
+        return ERR_PTR(-ENOMEM);
+    filp->fd = open(name, flags, mode);
+    if (filp->fd < 0) {
+        free(filp);
+        return ERR_PTR(-errno);
+    }
+    return filp;
+}
+
+int filp_close(struct file *filp, void *id)
+{
+    int ret = close(filp->fd);
+
+    free(filp);
+    return ret ? -errno : 0;
+}
+
+ssize_t vfs_read(struct file *filp, char *buf, size_t len, loff_t *pos)
+{
+    ssize_t ret = pread(filp->fd, buf, len, *pos);
+
+    if (ret < 0)
+        return -errno;
+    *pos += ret;
+    return ret;
+}
+
+ssize_t vfs_write(struct file *filp, const char *buf, size_t len, loff_t *pos)
+{
+    ssize_t ret = pwrite(filp->fd, buf, len, *pos);
+
+    if (ret < 0)
+        return -errno;
+    *pos += ret;
+    return ret;
+}
+
+// 只有deflate, 与内核的deflate一样使用不带头部的原始格式
+struct crypto_comp *crypto_alloc_comp(const char *name, u32 type, u32 mask)
+{
+    struct crypto_comp *tfm;
+
+    if (strcmp(name, "deflate"))
+        return ERR_PTR(-ENOENT);
+    tfm = malloc(sizeof(struct crypto_comp));
+    if (!tfm)
+        return ERR_PTR(-ENOMEM);
+    tfm->level = Z_DEFAULT_COMPRESSION;
+    return tfm;
+}
+
+int crypto_comp_compress(struct crypto_comp *tfm, const u8 *src, unsigned int slen,
+                        u8 *dst, unsigned int *dlen)
+{
+    z_stream zs;
+    int ret;
+
+    memset(&zs, 0, sizeof(zs));
+    if (deflateInit2(&zs, tfm->level, Z_DEFLATED, -MAX_WBITS, 8,
+                    Z_DEFAULT_STRATEGY) != Z_OK)
+        return -EINVAL;
+    zs.next_in = (u8 *)src;
+    zs.avail_in = slen;
+    zs.next_out = dst;
+    zs.avail_out = *dlen;
+    ret = deflate(&zs, Z_FINISH);
+    *dlen = zs.total_out;
+    deflateEnd(&zs);
+    return ret == Z_STREAM_END ? 0 : -EINVAL;
+}
+
+int crypto_comp_decompress(struct crypto_comp *tfm, const u8 *src,
+                        unsigned int slen, u8 *dst, unsigned int *dlen)
+{
+    z_stream zs;
+    int ret;
+
+    memset(&zs, 0, sizeof(zs));
+    if (inflateInit2(&zs, -MAX_WBITS) != Z_OK)
+        return -EINVAL;
+    zs.next_in = (u8 *)src;
+    zs.avail_in = slen;
+    zs.next_out = dst;
+    zs.avail_out = *dlen;
+    ret = inflate(&zs, Z_FINISH);
+    *dlen = zs.total_out;
+    inflateEnd(&zs);
+    return ret == Z_STREAM_END ? 0 : -EINVAL;
+}
@@ -0,0 +1,329 @@
+/*
+ * shim.h -- 存储引擎(engine.c, pool.c, cow.c, tier.c, zip.c)使用的内核接口
+ * 编译内核模块时只是包含相应的内核头文件; 不定义__KERNEL__时
+ * 以libc和pthread实现同名的替代品, 使存储引擎可以在用户空间编译,
+ * 在任何Linux机器上用perf等工具剖析数据结构和分配策略的改动
+ *
+ * 用户空间版本的限制:
+ *  - 信号量和自旋锁都是pthread互斥锁
+ *  - call_rcu只把回调挂起, 到rcu_barrier时才执行, 两者之间被替换下的
+ *    内存不会释放; synchronize_rcu不等待任何读者. 因此释放数据的操作
+ *    (trim, 打洞, 重整)不能与读者并发, 基准程序在单独的阶段中执行它们
+ *  - 工作队列的工作在queue_work/schedule_work中同步执行, 没有定时器,
+ *    延迟的工作不会执行
+ *  - 用户空间的"用户缓冲区"就是普通内存, copy_*_user即memcpy
+ *  - 文件是普通的文件描述符, vfs_read/vfs_write即pread/pwrite
+ *  - 压缩接口只支持deflate, 由zlib实现
+ */
+
+#ifndef _SCULL_SHIM_H_
+#define _SCULL_SHIM_H_
+
+#ifdef __KERNEL__
+
+#include <asm/semaphore.h>
+#include <asm/uaccess.h>
+#include <asm/div64.h>		// do_div()
+#include <linux/errno.h>
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/mm.h>
+#include <linux/fs.h>
+#include <linux/cdev.h>
+#include <linux/types.h>
+#include <linux/sched.h>		// cond_resched()
+#include <linux/spinlock.h>
+#include <linux/rcupdate.h>
+#include <linux/pagemap.h>		// fault_in_pages_writeable()
+#include <linux/uio.h>			// struct iovec, iov_length()
+#include <linux/workqueue.h>
+#include <linux/err.h>			// ERR_PTR()
+#include <linux/wait.h>
+
+#else /* 用户空间 */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <stddef.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+typedef unsigned char u8;
+typedef unsigned int u32;
+typedef unsigned long long u64;
+
+#define __user
+#define ERESTARTSYS		512
+
+#define printk			printf
+#define KERN_NOTICE		""
+#define KERN_WARNING	""
+#define KERN_DEBUG		""
+
+#define module_param(name, type, perm)
+
+#define min(x, y) ({ typeof(x) _x = (x); typeof(y) _y = (y); _x < _y ? _x : _y; })
+#define max(x, y) ({ typeof(x) _x = (x); typeof(y) _y = (y); _x > _y ? _x : _y; })
+
+#ifndef container_of
+#define container_of(ptr, type, member) \
+	((type *)((char *)(ptr) - offsetof(type, member)))
+#endif
+
+// 错误码编码在指针中
+#define ERR_PTR(err)	((void *)(long)(err))
+#define PTR_ERR(ptr)	((long)(ptr))
+#define IS_ERR(ptr)		((unsigned long)(ptr) >= (unsigned long)-4095)
+
+// 内存
+#define GFP_KERNEL		0
+#define __GFP_COMP		0
+#define __GFP_NOWARN	0
+#define __GFP_NORETRY	0
+#define PAGE_SHIFT		12
+#define PAGE_SIZE		(1UL << PAGE_SHIFT)
+#define VMALLOC_START	0UL		// 用户空间没有vmalloc回退, 量子都不是vmalloc得到的
+#define VMALLOC_END		0UL
+
+#define SLAB_HWCACHE_ALIGN		0
+
+#define kmalloc(size, flags)	malloc(size)
+#define kfree(p)				free(p)
+#define vmalloc(size)			malloc(size)
+#define vfree(p)				free(p)
+
+// slab缓存: 只记录对象大小, 对象直接由malloc申请
+typedef struct kmem_cache_s {
+	size_t size;
+} kmem_cache_t;
+
+static inline kmem_cache_t *kmem_cache_create(const char *name, size_t size,
+				size_t align, unsigned long flags, void *ctor, void *dtor)
+{
+	kmem_cache_t *cache = malloc(sizeof(kmem_cache_t));
+
+	if (cache)
+		cache->size = size;
+	return cache;
+}
+#define kmem_cache_alloc(cache, flags)	malloc((cache)->size)
+#define kmem_cache_free(cache, p)		free(p)
+#define kmem_cache_destroy(cache)		free(cache)
+
+// 散列
+static inline unsigned long hash_long(unsigned long val, unsigned int bits)
+{
+	return (val * 0x9e370001UL) >> (sizeof(long) * 8 - bits);
+}
+
+static inline int get_order(unsigned long size)
+{
+	int order = 0;
+
+	size = (size - 1) >> PAGE_SHIFT;
+	while (size) {
+		order++;
+		size >>= 1;
+	}
+	return order;
+}
+
+static inline unsigned long __get_free_pages(int flags, int order)
+{
+	void *p;
+
+	if (posix_memalign(&p, PAGE_SIZE, PAGE_SIZE << order))
+		return 0;
+	return (unsigned long)p;
+}
+
+#define __get_free_page(flags)		__get_free_pages(flags, 0)
+#define free_pages(addr, order)		free((void *)(addr))
+
+// 空洞读出的0来自这一页
+extern char scull_zero_page[];
+#define ZERO_PAGE(vaddr)		((void *)scull_zero_page)
+#define page_address(page)		((void *)(page))
+
+// 用户缓冲区
+#define copy_to_user(to, from, n)	(memcpy(to, from, n), 0UL)
+#define copy_from_user(to, from, n)	(memcpy(to, from, n), 0UL)
+#define __copy_to_user_inatomic(to, from, n)	(memcpy(to, from, n), 0UL)
+#define fault_in_pages_writeable(uaddr, size)	0
+
+static inline size_t iov_length(const struct iovec *iov, unsigned long nr_segs)
+{
+	size_t ret = 0;
+
+	while (nr_segs--)
+		ret += (iov++)->iov_len;
+	return ret;
+}
+
+// 64位除法, 返回余数, 商写回n
+#define do_div(n, base)	({ unsigned int __rem = (n) % (base); (n) /= (base); __rem; })
+
+#define WARN_ON(cond)	({ int __c = !!(cond);	\
+	if (__c)								\
+		fprintf(stderr, "WARN_ON at %s:%d\n", __FILE__, __LINE__);	\
+	__c; })
+
+// 同步
+#define smp_wmb()		__sync_synchronize()
+#define smp_rmb()		__sync_synchronize()
+#define smp_mb()		__sync_synchronize()
+#define cpu_relax()		do { } while (0)
+#define cond_resched()	do { } while (0)
+
+#define BITS_PER_LONG		(__SIZEOF_LONG__ * 8)
+#define BITS_TO_LONGS(n)	(((n) + BITS_PER_LONG - 1) / BITS_PER_LONG)
+#define set_bit(nr, addr)	\
+	__sync_fetch_and_or((addr) + (nr) / BITS_PER_LONG, 1UL << ((nr) % BITS_PER_LONG))
+#define clear_bit(nr, addr)	\
+	__sync_fetch_and_and((addr) + (nr) / BITS_PER_LONG, ~(1UL << ((nr) % BITS_PER_LONG)))
+#define test_bit(nr, addr)	\
+	(((addr)[(nr) / BITS_PER_LONG] >> ((nr) % BITS_PER_LONG)) & 1)
+static inline int test_and_clear_bit(int nr, unsigned long *addr)
+{
+	unsigned long mask = 1UL << (nr % BITS_PER_LONG);
+
+	return (__sync_fetch_and_and(addr + nr / BITS_PER_LONG, ~mask) & mask) != 0;
+}
+
+typedef struct { volatile int counter; } atomic_t;
+#define ATOMIC_INIT(i)		{ (i) }
+#define atomic_set(v, i)	((v)->counter = (i))
+#define atomic_read(v)		((v)->counter)
+#define atomic_inc(v)		__sync_fetch_and_add(&(v)->counter, 1)
+#define atomic_dec(v)		__sync_fetch_and_sub(&(v)->counter, 1)
+#define atomic_dec_and_test(v)	(__sync_sub_and_fetch(&(v)->counter, 1) == 0)
+
+typedef struct { volatile long counter; } atomic_long_t;
+#define atomic_long_set(v, i)			((v)->counter = (i))
+#define atomic_long_read(v)				((v)->counter)
+#define atomic_long_add(i, v)			__sync_fetch_and_add(&(v)->counter, (i))
+#define atomic_long_sub(i, v)			__sync_fetch_and_sub(&(v)->counter, (i))
+#define atomic_long_add_return(i, v)	__sync_add_and_fetch(&(v)->counter, (i))
+
+struct semaphore {
+	pthread_mutex_t lock;
+};
+#define init_MUTEX(sem)				pthread_mutex_init(&(sem)->lock, NULL)
+#define down(sem)					pthread_mutex_lock(&(sem)->lock)
+#define down_interruptible(sem)		pthread_mutex_lock(&(sem)->lock)
+#define up(sem)						pthread_mutex_unlock(&(sem)->lock)
+#define DECLARE_MUTEX(name)	\
+	struct semaphore name = { PTHREAD_MUTEX_INITIALIZER }
+
+typedef pthread_mutex_t spinlock_t;
+#define SPIN_LOCK_UNLOCKED			PTHREAD_MUTEX_INITIALIZER
+#define spin_lock_init(lock)		pthread_mutex_init(lock, NULL)
+#define spin_lock(lock)				pthread_mutex_lock(lock)
+#define spin_unlock(lock)			pthread_mutex_unlock(lock)
+
+// 等待队列: 用户空间没有poll, 唤醒什么也不做, 等待者让出CPU轮询条件
+typedef struct { int unused; } wait_queue_head_t;
+#define init_waitqueue_head(q)		do { } while (0)
+#define wake_up(q)					do { } while (0)
+#define wake_up_interruptible(q)	do { } while (0)
+#define wait_event(q, cond)			do { while (!(cond)) sched_yield(); } while (0)
+
+// RCU: 读者不做任何事, 回调推迟到rcu_barrier
+struct rcu_head {
+	struct rcu_head *next;
+	void (*func)(struct rcu_head *head);
+};
+#define rcu_read_lock()				do { } while (0)
+#define rcu_read_unlock()			do { } while (0)
+#define rcu_dereference(p)			(p)
+#define rcu_assign_pointer(p, v)	({ __sync_synchronize(); (p) = (v); })
+#define synchronize_rcu()			do { } while (0)
+void call_rcu(struct rcu_head *head, void (*func)(struct rcu_head *head));
+void rcu_barrier(void);
+
+// 工作队列: 同步执行
+struct workqueue_struct;
+struct work_struct {
+	void (*func)(void *data);
+	void *data;
+};
+#define INIT_WORK(work, fn, arg)	((work)->func = (fn), (work)->data = (arg))
+static inline int schedule_work(struct work_struct *work)
+{
+	work->func(work->data);
+	return 1;
+}
+#define queue_work(wq, work)		schedule_work(work)
+#define flush_workqueue(wq)			do { } while (0)
+#define flush_scheduled_work()		do { } while (0)
+#define HZ							100
+#define queue_delayed_work(wq, work, delay)	({ (void)(work); 0; })
+#define cancel_delayed_work(work)	({ (void)(work); 0; })
+#define schedule_delayed_work(work, delay)	({ (void)(work); 0; })
+#define jiffies						0UL
+#define time_before(a, b)			((long)((a) - (b)) < 0)
+
+// 文件: 只有内核缓冲区与文件之间的读写
+struct file {
+	int fd;
+};
+typedef int mm_segment_t;
+#define KERNEL_DS		0
+#define get_fs()		KERNEL_DS
+#define set_fs(fs)		((void)(fs))
+struct file *filp_open(const char *name, int flags, int mode);
+int filp_close(struct file *filp, void *id);
+ssize_t vfs_read(struct file *filp, char *buf, size_t len, loff_t *pos);
+ssize_t vfs_write(struct file *filp, const char *buf, size_t len, loff_t *pos);
+
+// 压缩接口
+struct crypto_comp {
+	int level;
+};
+struct crypto_comp *crypto_alloc_comp(const char *name, u32 type, u32 mask);
+#define crypto_free_comp(tfm)		free(tfm)
+int crypto_comp_compress(struct crypto_comp *tfm, const u8 *src, unsigned int slen,
+				u8 *dst, unsigned int *dlen);
+int crypto_comp_decompress(struct crypto_comp *tfm, const u8 *src,
+				unsigned int slen, u8 *dst, unsigned int *dlen);
+
+// 字符设备: 存储引擎只用到设备号
+struct cdev {
+	unsigned int dev;
+};
+#define MINOR(dev)		((unsigned int)(dev) & 0xfffff)
+
+// 统计信息和跟踪点只在内核模块中实现
+struct scull_dev;
+
+static inline u64 scull_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline void scull_stats_init(struct scull_dev *dev) { }
+static inline void scull_stats_free(struct scull_dev *dev) { }
+static inline void scull_stat_op(struct scull_dev *dev, int op, size_t want,
+						ssize_t done, u64 ns) { }
+static inline void scull_stat_sem_wait(struct scull_dev *dev, u64 start) { }
+static inline void scull_stat_alloc_fail(struct scull_dev *dev) { }
+static inline void scull_stat_zero_dedup(struct scull_dev *dev) { }
+static inline void scull_stat_cow(struct scull_dev *dev) { }
+static inline void scull_stat_tier(struct scull_dev *dev, int event) { }
+
+#endif /* __KERNEL__ */
+
+#endif /* _SCULL_SHIM_H_ */
@@ -0,0 +1,276 @@
+/*
+ * stats.c -- scull设备的统计信息
+ * 计数器和延迟直方图按CPU分别保存, 更新时只关闭抢占, 不获取任何锁
+ * 通过 /proc/scullstats 输出, 读取时累加所有CPU的值, 不获取dev->sem
+ * 延迟直方图以2的幂(纳秒)为桶, 第i个桶记录 [2^(i-1), 2^i) 纳秒的操作
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/fs.h>
+#include <linux/cdev.h>
+#include <linux/percpu.h>
+#include <linux/smp.h>
+#include <linux/ktime.h>
+#include <linux/hrtimer.h>
+#include <linux/proc_fs.h>
+#include <linux/seq_file.h>
+
+#include "scull.h"
+
+static const char *scull_op_names[SCULL_NR_OPS] = {
+    "read", "write", "trim", "inflate"
+};
+
+// 当前时间, 纳秒
+u64 scull_now(void)
+{
+    return ktime_to_ns(ktime_get());
+}
+
+// 为设备申请按CPU的计数器, 失败时该设备不做统计
+void scull_stats_init(struct scull_dev *dev)
+{
+    dev->stats = alloc_percpu(struct scull_cpu_stats);
+    if (!dev->stats)
+        printk(KERN_NOTICE "scull: no memory for statistics\n");
+}
+
+void scull_stats_free(struct scull_dev *dev)
+{
+    if (dev->stats)
+        free_percpu(dev->stats);
+    dev->stats = NULL;
+}
+
+// 延迟所在的直方图桶, 超过2^31纳秒的都记入最后一个桶
+static inline int scull_hist_bucket(u64 ns)
+{
+    if (ns >> 31)
+        return SCULL_HIST_BUCKETS - 1;
+    return fls((u32)ns);
+}
+
+/**
+ * 记录一次耗时ns纳秒的读写或trim, want为请求的字节数, done为完成的字节数(出错时为负)
+ * 读操作完成的字节数少于请求时计为一次短读
+ */
+void scull_stat_op(struct scull_dev *dev, int op, size_t want, ssize_t done,
+                    u64 ns)
+{
+    struct scull_cpu_stats *st;
+
+    if (!dev->stats)
+        return;
+    st = per_cpu_ptr(dev->stats, get_cpu());
+    st->ops[op]++;
+    if (done > 0)
+        st->bytes[op] += done;
+    if (op == SCULL_OP_READ && done >= 0 && (size_t)done < want)
+        st->short_reads++;
+    st->hist[op][scull_hist_bucket(ns)]++;
+    put_cpu();
+}
+
+// 记录在dev->sem上等待的时间
+void scull_stat_sem_wait(struct scull_dev *dev, u64 start)
+{
+    u64 ns = scull_now() - start;
+
+    if (!dev->stats)
+        return;
+    per_cpu_ptr(dev->stats, get_cpu())->sem_wait_ns += ns;
+    put_cpu();
+}
+
+// 记录一次内存申请失败
+void scull_stat_alloc_fail(struct scull_dev *dev)
+{
+    if (!dev->stats)
+        return;
+    per_cpu_ptr(dev->stats, get_cpu())->alloc_fails++;
+    put_cpu();
+}
+
+// 记录一次以SCULL_ZERO_QUANTUM代替量子的全0写入
+void scull_stat_zero_dedup(struct scull_dev *dev)
+{
+    if (!dev->stats)
+        return;
+    per_cpu_ptr(dev->stats, get_cpu())->zero_dedups++;
+    put_cpu();
+}
+
+// 记录一次共享量子的写时复制
+void scull_stat_cow(struct scull_dev *dev)
+{
+    if (!dev->stats)
+        return;
+    per_cpu_ptr(dev->stats, get_cpu())->cow_copies++;
+    put_cpu();
+}
+
+// 记录一次分层存储事件(SCULL_TIER_*)
+void scull_stat_tier(struct scull_dev *dev, int event)
+{
+    struct scull_cpu_stats *st;
+
+    if (!dev->stats)
+        return;
+    st = per_cpu_ptr(dev->stats, get_cpu());
+    if (event == SCULL_TIER_HIT)
+        st->tier_hits++;
+    else if (event == SCULL_TIER_MISS)
+        st->tier_misses++;
+    else
+        st->tier_evictions++;
+    put_cpu();
+}
+
+// 累加所有CPU的计数器, 读取期间计数器可能仍在变化, 结果是近似值
+static void scull_stats_sum(struct scull_dev *dev, struct scull_cpu_stats *sum)
+{
+    struct scull_cpu_stats *st;
+    int cpu, op, i;
+
+    memset(sum, 0, sizeof(*sum));
+    if (!dev->stats)
+        return;
+    for_each_possible_cpu(cpu) {
+        st = per_cpu_ptr(dev->stats, cpu);
+        for (op = 0; op < SCULL_NR_OPS; op++) {
+            sum->ops[op] += st->ops[op];
+            sum->bytes[op] += st->bytes[op];
+            for (i = 0; i < SCULL_HIST_BUCKETS; i++)
+                sum->hist[op][i] += st->hist[op][i];
+        }
+        sum->short_reads += st->short_reads;
+        sum->alloc_fails += st->alloc_fails;
+        sum->zero_dedups += st->zero_dedups;
+        sum->cow_copies += st->cow_copies;
+        sum->tier_hits += st->tier_hits;
+        sum->tier_misses += st->tier_misses;
+        sum->tier_evictions += st->tier_evictions;
+        sum->sem_wait_ns += st->sem_wait_ns;
+    }
+}
+
+/**
+ * seq_file迭代器, 每个scull设备输出一段:
+ *   dev 0
+ *    read: ops 10 bytes 40960 short 1
+ *    read_lat_ns: 1024:3 2048:7
+ * 直方图只输出非空的桶, 键为桶的上限(纳秒)
+ */
+static void *scull_stats_start(struct seq_file *s, loff_t *pos)
+{
+    if (*pos >= scull_nr_devs)
+        return NULL;
+    return scull_devices + *pos;
+}
+
+static void *scull_stats_next(struct seq_file *s, void *v, loff_t *pos)
+{
+    (*pos)++;
+    if (*pos >= scull_nr_devs)
+        return NULL;
+    return scull_devices + *pos;
+}
+
+static void scull_stats_stop(struct seq_file *s, void *v)
+{
+    // do nothing
+}
+
+static int scull_stats_show(struct seq_file *s, void *v)
+{
+    struct scull_dev *dev = v;
+    struct scull_cpu_stats *sum;
+    struct scull_mem mem;
+    unsigned long orig, ratio;
+    int op, i;
+
+    // 结构体较大, 不放在栈上
+    sum = kmalloc(sizeof(*sum), GFP_KERNEL);
+    if (!sum)
+        return -ENOMEM;
+    scull_stats_sum(dev, sum);
+
+    seq_printf(s, "dev %i\n", (int)(dev - scull_devices));
+    for (op = 0; op < SCULL_NR_OPS; op++) {
+        seq_printf(s, " %s: ops %lu bytes %llu", scull_op_names[op],
+                    sum->ops[op], sum->bytes[op]);
+        if (op == SCULL_OP_READ)
+            seq_printf(s, " short %lu", sum->short_reads);
+        seq_printf(s, "\n");
+    }
+    seq_printf(s, " alloc_fails: %lu\n", sum->alloc_fails);
+    seq_printf(s, " zero_dedups: %lu\n", sum->zero_dedups);
+    seq_printf(s, " cow_copies: %lu\n", sum->cow_copies);
+    seq_printf(s, " tier: hits %lu misses %lu evictions %lu resident %ld cap %lu\n",
+                sum->tier_hits, sum->tier_misses, sum->tier_evictions,
+                atomic_long_read(&dev->pool.in_use) -
+                atomic_long_read(&dev->tier_pending), dev->mem_cap);
+    // 压缩比: 压缩前后的字节数之比, 保留两位小数
+    orig = atomic_long_read(&dev->zip_orig);
+    ratio = atomic_long_read(&dev->zip_bytes);
+    ratio = ratio ? orig * 100 / ratio : 0;
+    seq_printf(s, " zip: idle %us orig %lu stored %lu ratio %lu.%02lu\n",
+                dev->zip_idle, orig, atomic_long_read(&dev->zip_bytes),
+                ratio / 100, ratio % 100);
+    seq_printf(s, " sem_wait_ns: %llu\n", sum->sem_wait_ns);
+    for (op = 0; op < SCULL_NR_OPS; op++) {
+        seq_printf(s, " %s_lat_ns:", scull_op_names[op]);
+        for (i = 0; i < SCULL_HIST_BUCKETS; i++)
+            if (sum->hist[op][i])
+                seq_printf(s, " %llu:%lu", 1ULL << i, sum->hist[op][i]);
+        seq_printf(s, "\n");
+    }
+    // 元数据: 索引和量子集节点; 数据: 量子
+    scull_mem_usage(dev, &mem);
+    seq_printf(s, " mem: index %lu qsets %lu/%lu quanta %lu/%lu zero %lu "
+                "shared %lu swapped %lu zipped %lu/%lu meta %lu%%\n",
+                mem.index_bytes, mem.nr_qsets, mem.qset_bytes, mem.nr_quanta,
+                mem.quantum_bytes, mem.nr_zero, mem.nr_shared, mem.nr_swapped,
+                mem.nr_zipped, mem.zipped_bytes,
+                mem.quantum_bytes ? (mem.index_bytes + mem.qset_bytes) * 100 /
+                                    mem.quantum_bytes : 0);
+    kfree(sum);
+    return 0;
+}
+
+static struct seq_operations scull_stats_seq_ops = {
+    .start = scull_stats_start,
+    .next = scull_stats_next,
+    .stop = scull_stats_stop,
+    .show = scull_stats_show
+};
+
+static int scull_stats_open(struct inode *inode, struct file *file)
+{
+    return seq_open(file, &scull_stats_seq_ops);
+}
+
+static struct file_operations scull_stats_proc_ops = {
+    .owner = THIS_MODULE,
+    .open = scull_stats_open,
+    .read = seq_read,
+    .llseek = seq_lseek,
+    .release = seq_release
+};
+
+// 与调试用的scullmem/scullseq不同, 统计文件总是存在
+void scull_stats_create_proc(void)
+{
+    struct proc_dir_entry *entry;
+
+    entry = create_proc_entry("scullstats", 0, NULL);
+    if (entry)
+        entry->proc_fops = &scull_stats_proc_ops;
+}
+
+void scull_stats_remove_proc(void)
+{
+    remove_proc_entry("scullstats", NULL);
+}
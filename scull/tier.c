@@ -0,0 +1,370 @@
+/*
+ * tier.c -- 分层存储: 热的量子留在内存中, 冷的量子换出到交换文件
+ * 设备i的交换文件为 "<scull_swap>i", 量子保存在与它在设备中的偏移相同的
+ * 位置, 因此不需要分配交换槽位, 量子集中的SCULL_SWAPPED_QUANTUM标记就
+ * 足以找到内容. 文件是稀疏的, 只有被换出过的范围占用磁盘
+ * 驻留的量子超过mem_cap时, scull_wq中的换出工作用CLOCK算法选择换出的
+ * 量子: 访问量子时设置引用位(scull_tier_touch), 换出者扫过时清除,
+ * 一圈之内没有被访问的量子被写入交换文件. 读者和写者遇到换出标记时
+ * 在量子集的信号量保护下把它调入(scull_tier_load), 压缩的量子(zip.c)
+ * 也在这里解压
+ * 与快照共享的量子不换出; 设备被映射期间不换出, 映射时全部调入
+ * 几何参数改变(trim, 重整)使所有位置失效, 重整之前先全部调入
+ */
+
+#include "shim.h"
+#ifdef __KERNEL__
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/file.h>
+#endif
+
+#include "scull.h"
+
+char *scull_swap;           // 交换文件名前缀, 为NULL时不分层
+int scull_mem_cap;          // 每个设备驻留内存的量子上限, 以KB为单位, 0为不限制
+
+module_param(scull_swap, charp, S_IRUGO);
+module_param(scull_mem_cap, int, S_IRUGO);
+
+#define SCULL_TIER_BATCH	64      // 每次持有dev->sem最多换出的量子数
+#define SCULL_TIER_BACKOFF	HZ      // 一圈都没有可换出的量子时, 等待这么久再扫描
+
+// 一批被换出或压缩的量子, 宽限期过后在scull_wq中归还到量子池
+struct scull_tier_batch {
+    struct rcu_head rcu;
+    struct work_struct work;
+    struct scull_dev *dev;
+    int quantum;
+    int nr;
+    void *q[SCULL_TIER_BATCH];
+};
+
+/**
+ * 在内核缓冲区和文件之间传输len字节, 返回传输的字节数或错误码
+ * 读到文件末尾时返回的字节数少于len
+ */
+ssize_t scull_file_io(struct file *filp, void *buf, size_t len, loff_t pos,
+                        int write)
+{
+    mm_segment_t old_fs = get_fs();
+    size_t done = 0;
+    ssize_t ret = 0;
+
+    set_fs(KERNEL_DS);
+    while (done < len) {
+        if (write)
+            ret = vfs_write(filp, (const char __user *)buf + done,
+                            len - done, &pos);
+        else
+            ret = vfs_read(filp, (char __user *)buf + done, len - done, &pos);
+        if (ret <= 0)
+            break;
+        done += ret;
+    }
+    set_fs(old_fs);
+    if (ret < 0)
+        return ret;
+    if (write && done < len)
+        return -EIO;
+    return done;
+}
+
+// 驻留内存中的量子字节数, 不包括已换出但尚未释放的
+static inline long scull_tier_resident(struct scull_dev *dev)
+{
+    return atomic_long_read(&dev->pool.in_use) -
+            atomic_long_read(&dev->tier_pending);
+}
+
+/**
+ * 读出偏移base处被换出的量子, 文件中没有写到的部分为0
+ * 调用者持有量子所在量子集的信号量
+ */
+ssize_t scull_tier_read(struct scull_dev *dev, void *buf, loff_t base,
+                        int quantum)
+{
+    ssize_t ret;
+
+    ret = scull_file_io(dev->swap, buf, quantum, base, 0);
+    if (ret >= 0 && ret < quantum)
+        memset((char *)buf + ret, 0, quantum - ret);
+    return ret < 0 ? ret : quantum;
+}
+
+/**
+ * 把dptr中第s_pos个被换出或压缩的量子调入内存, base为它在设备中的偏移,
+ * quantum和qset为dptr所在索引的几何参数
+ * 调用者持有dptr->sem, 返回调入的量子; 失败时返回NULL(内存不足)
+ * 或ERR_PTR, 量子仍然是换出或压缩的
+ */
+void *scull_tier_load(struct scull_dev *dev, struct scull_qset *dptr, int s_pos,
+                        loff_t base, int quantum, int qset)
+{
+    void *old = dptr->data[s_pos];
+    ssize_t ret;
+    void *q;
+
+    q = scull_pool_get_quantum(&dev->pool, quantum);
+    if (!q) {
+        scull_stat_alloc_fail(dev);
+        return NULL;
+    }
+    if (scull_quantum_zipped(old))
+        ret = scull_unzip(dev, old, q, quantum);
+    else
+        ret = scull_tier_read(dev, q, base, quantum);
+    if (ret < 0) {
+        scull_pool_put_quantum(&dev->pool, q, quantum);
+        return ERR_PTR(ret);
+    }
+    rcu_assign_pointer(dptr->data[s_pos], q);
+    // 刚调入的量子至少要经过一圈才会再被换出或压缩
+    set_bit(s_pos, scull_qset_ref(dptr, qset));
+    if (scull_quantum_zipped(old))
+        scull_zip_free(dev, old, quantum);
+    else
+        scull_stat_tier(dev, SCULL_TIER_MISS);
+    return q;
+}
+
+/**
+ * 不持有任何锁的读者遇到换出标记或压缩的量子时调用, 调入pos所在的量子
+ * 返回后读者重新查找; 期间量子可能已被别人调入, 或者设备已被清空
+ */
+int scull_tier_fault(struct scull_dev *dev, loff_t pos)
+{
+    struct scull_qset *dptr;
+    struct scull_geom g;
+    void *q = NULL;
+    int s_pos;
+
+    dptr = scull_get_qset(dev, pos, 0, &g);
+    if (IS_ERR(dptr))
+        return PTR_ERR(dptr);
+    if (!dptr)
+        return 0;
+    s_pos = g.rest / g.quantum;
+    if (scull_quantum_cold(dptr->data[s_pos])) {
+        q = scull_tier_load(dev, dptr, s_pos, pos - g.rest % g.quantum,
+                            g.quantum, g.qset);
+        if (!q)
+            q = ERR_PTR(-ENOMEM);
+    }
+    up(&dptr->sem);
+    if (IS_ERR(q))
+        return PTR_ERR(q);
+    scull_tier_check(dev);
+    return 0;
+}
+
+// 工作队列函数: 归还一批被替换下的量子
+static void scull_tier_free_work(void *data)
+{
+    struct scull_tier_batch *batch = data;
+    struct scull_dev *dev = batch->dev;
+    int i;
+
+    for (i = 0; i < batch->nr; i++)
+        scull_pool_put_quantum(&dev->pool, batch->q[i], batch->quantum);
+    atomic_long_sub((long)batch->nr * batch->quantum, &dev->tier_pending);
+    kfree(batch);
+}
+
+// RCU回调运行在软中断上下文, 量子池的锁不能在这里获取
+static void scull_tier_free_rcu(struct rcu_head *head)
+{
+    struct scull_tier_batch *batch = container_of(head, struct scull_tier_batch, rcu);
+
+    queue_work(scull_wq, &batch->work);
+}
+
+/**
+ * 被换出或压缩的量子先收集到一批中, 宽限期过后一起归还到量子池
+ * 期间它们不再计入驻留量
+ */
+struct scull_tier_batch *scull_tier_batch_alloc(struct scull_dev *dev, int quantum)
+{
+    struct scull_tier_batch *batch;
+
+    batch = kmalloc(sizeof(struct scull_tier_batch), GFP_KERNEL);
+    if (!batch)
+        return NULL;
+    batch->dev = dev;
+    batch->quantum = quantum;
+    batch->nr = 0;
+    INIT_WORK(&batch->work, scull_tier_free_work, batch);
+    return batch;
+}
+
+// 把已从量子集中替换下的量子q加入批次, 批次满时返回1
+int scull_tier_batch_add(struct scull_tier_batch *batch, void *q)
+{
+    batch->q[batch->nr++] = q;
+    atomic_long_add(batch->quantum, &batch->dev->tier_pending);
+    return batch->nr == SCULL_TIER_BATCH;
+}
+
+// 提交批次, 宽限期后释放其中的量子; 空的批次直接释放
+void scull_tier_batch_done(struct scull_tier_batch *batch)
+{
+    if (batch->nr)
+        call_rcu(&batch->rcu, scull_tier_free_rcu);
+    else
+        kfree(batch);
+}
+
+/**
+ * 从CLOCK指针处继续扫描, 换出最多一批量子, 直到驻留量降到limit以下
+ * 调用者持有dev->sem, 索引和几何参数不会改变. 返回换出的量子数,
+ * 扫描一圈都没有可换出的量子时返回0; 这一圈清除了引用位, 之后没有
+ * 再被访问的量子下一圈可以换出, 刚调入的量子不会在同一次扫描中被换出
+ */
+static int scull_tier_sweep(struct scull_dev *dev, struct scull_tier_batch *batch,
+                            long limit)
+{
+    struct scull_index *idx = dev->data;
+    struct scull_qset *dptr;
+    unsigned long *ref;
+    long itemsize;
+    loff_t base;
+    ssize_t ret;
+    int scanned, j;
+    void *q;
+
+    if (!idx || !idx->nitems)
+        return 0;
+    itemsize = (long)idx->quantum * idx->qset;
+    for (scanned = 0; scanned <= idx->nitems; scanned++) {
+        if (dev->tier_item >= idx->nitems || dev->tier_slot >= idx->qset) {
+            dev->tier_item = (dev->tier_item + 1) % idx->nitems;
+            dev->tier_slot = 0;
+        }
+        dptr = idx->items[dev->tier_item];
+        if (!dptr) {
+            dev->tier_slot = idx->qset;
+            continue;
+        }
+        down(&dptr->sem);
+        ref = scull_qset_ref(dptr, idx->qset);
+        for (j = dev->tier_slot; j < idx->qset; j++) {
+            if (batch->nr == SCULL_TIER_BATCH || scull_tier_resident(dev) <= limit)
+                break;
+            q = dptr->data[j];
+            if (!scull_quantum_real(q) || test_and_clear_bit(j, ref) ||
+                    scull_qset_quantum_shared(dptr, idx->qset, j))
+                continue;
+            base = (loff_t)dev->tier_item * itemsize + (loff_t)j * idx->quantum;
+            ret = scull_file_io(dev->swap, q, idx->quantum, base, 1);
+            if (ret < 0) {
+                printk(KERN_WARNING "scull: swap out failed (%i)\n", (int)ret);
+                break;
+            }
+            // 之前开始的读者仍可以读旧量子, 宽限期后才释放
+            rcu_assign_pointer(dptr->data[j], SCULL_SWAPPED_QUANTUM);
+            scull_tier_batch_add(batch, q);
+            scull_stat_tier(dev, SCULL_TIER_EVICT);
+        }
+        up(&dptr->sem);
+        dev->tier_slot = j;
+        if (j < idx->qset)
+            break;
+    }
+    return batch->nr;
+}
+
+/**
+ * 工作队列函数: 把驻留量换出到上限的7/8以下, 留出余量避免每次写入都唤醒
+ * 每批之间释放dev->sem, 让结构性修改和调入者有机会执行
+ * 一圈都没有可换出的量子(都刚被访问过或被共享)时不再空转,
+ * SCULL_TIER_BACKOFF之后再试; 在dev->sem下决定, 与scull_tier_stop配对
+ */
+static void scull_tier_work(void *data)
+{
+    struct scull_dev *dev = data;
+    struct scull_tier_batch *batch;
+    long limit;
+    int nr;
+
+    for (;;) {
+        limit = dev->mem_cap - dev->mem_cap / 8;
+        if (!dev->swap || !dev->mem_cap || scull_tier_resident(dev) <= limit)
+            break;
+        down(&dev->sem);
+        batch = dev->data ? scull_tier_batch_alloc(dev, dev->data->quantum) : NULL;
+        // 被映射的量子由页表直接引用, 不能换出
+        nr = !batch || atomic_read(&dev->vmas) ? 0 :
+                scull_tier_sweep(dev, batch, limit);
+        if (!nr && batch && !atomic_read(&dev->vmas) && dev->mem_cap)
+            queue_delayed_work(scull_wq, &dev->tier_work, SCULL_TIER_BACKOFF);
+        up(&dev->sem);
+        if (batch)
+            scull_tier_batch_done(batch);
+        if (!nr)
+            break;
+        cond_resched();
+    }
+}
+
+void scull_tier_init(struct scull_dev *dev)
+{
+    dev->swap = NULL;
+    dev->mem_cap = 0;
+    atomic_long_set(&dev->tier_pending, 0);
+    dev->tier_item = dev->tier_slot = 0;
+    INIT_WORK(&dev->tier_work, scull_tier_work, dev);
+}
+
+// 停止换出, 调用者随后清空scull_wq
+void scull_tier_stop(struct scull_dev *dev)
+{
+    down(&dev->sem);
+    dev->mem_cap = 0;
+    up(&dev->sem);
+    cancel_delayed_work(&dev->tier_work);
+}
+
+/**
+ * 创建设备的交换文件, index为设备在scull_devices中的序号
+ * 没有设置scull_swap时什么也不做
+ */
+int scull_tier_setup(struct scull_dev *dev, int index)
+{
+    struct file *filp;
+    size_t len;
+    char *name;
+
+    if (!scull_swap)
+        return 0;
+    len = strlen(scull_swap) + 12;
+    name = kmalloc(len, GFP_KERNEL);
+    if (!name)
+        return -ENOMEM;
+    snprintf(name, len, "%s%i", scull_swap, index);
+    filp = filp_open(name, O_RDWR | O_CREAT | O_TRUNC | O_LARGEFILE, 0600);
+    kfree(name);
+    if (IS_ERR(filp))
+        return PTR_ERR(filp);
+    dev->swap = filp;
+    dev->mem_cap = (unsigned long)scull_mem_cap << 10;
+    return 0;
+}
+
+// 关闭交换文件, 调用者保证设备已被清空, 换出工作不再运行
+void scull_tier_release(struct scull_dev *dev)
+{
+    dev->mem_cap = 0;
+    if (dev->swap)
+        filp_close(dev->swap, NULL);
+    dev->swap = NULL;
+}
+
+// 设置驻留上限(字节), 降低上限时立即开始换出
+int scull_set_mem_cap(struct scull_dev *dev, unsigned long cap)
+{
+    if (!dev->swap)
+        return -ENODEV;
+    dev->mem_cap = cap;
+    scull_tier_check(dev);
+    return 0;
+}
@@ -0,0 +1,62 @@
+/*
+ * trace.h -- scull的跟踪挂接点
+ * 本模块依赖的readv/writev, sendfile, nopage等接口在引入TRACE_EVENT的
+ * 2.6.32之前就已移除, 因此不使用静态跟踪点, 而是在热路径上调用不内联的
+ * 空函数, 用kprobes或SystemTap按函数名挂接, 从参数中取得各字段
+ * engine.c在包含本文件之前定义CREATE_TRACE_POINTS, 生成挂接点的实体;
+ * 在用户空间编译时是内联的空函数
+ * 所有事件以次设备号标识设备, ns为操作耗费的纳秒数
+ */
+
+#ifndef _SCULL_TRACE_H_
+#define _SCULL_TRACE_H_
+
+#ifdef __KERNEL__
+
+#include <linux/compiler.h>     // noinline, barrier()
+
+// 读写: pos为起始位置, count为请求的字节数, ret为返回值
+void trace_scull_read(int minor, loff_t pos, size_t count, ssize_t ret, u64 ns);
+void trace_scull_write(int minor, loff_t pos, size_t count, ssize_t ret, u64 ns);
+/**
+ * 定位量子集: item为项号; 索引数组直接以项号为下标, 不再逐项遍历,
+ * hops记录为此扩展索引数组的次数(0表示一次直接命中)
+ */
+void trace_scull_follow(int minor, int item, int hops, int created);
+// 申请量子: hit表示从量子池中取得
+void trace_scull_quantum_alloc(int minor, int quantum, int hit, u64 ns);
+// 清空设备: size为清空前的大小
+void trace_scull_trim(int minor, unsigned long size, int ret, u64 ns);
+
+#ifdef CREATE_TRACE_POINTS
+
+// barrier()使编译器不能把调用当作没有副作用而删除
+noinline void trace_scull_read(int minor, loff_t pos, size_t count,
+                                ssize_t ret, u64 ns) { barrier(); }
+noinline void trace_scull_write(int minor, loff_t pos, size_t count,
+                                ssize_t ret, u64 ns) { barrier(); }
+noinline void trace_scull_follow(int minor, int item, int hops,
+                                int created) { barrier(); }
+noinline void trace_scull_quantum_alloc(int minor, int quantum, int hit,
+                                u64 ns) { barrier(); }
+noinline void trace_scull_trim(int minor, unsigned long size, int ret,
+                                u64 ns) { barrier(); }
+
+#endif
+
+#else /* 在用户空间编译 */
+
+static inline void trace_scull_read(int minor, loff_t pos, size_t count,
+                                    ssize_t ret, u64 ns) { }
+static inline void trace_scull_write(int minor, loff_t pos, size_t count,
+                                    ssize_t ret, u64 ns) { }
+static inline void trace_scull_follow(int minor, int item, int hops,
+                                    int created) { }
+static inline void trace_scull_quantum_alloc(int minor, int quantum, int hit,
+                                    u64 ns) { }
+static inline void trace_scull_trim(int minor, unsigned long size, int ret,
+                                    u64 ns) { }
+
+#endif
+
+#endif /* _SCULL_TRACE_H_ */
@@ -0,0 +1,245 @@
+/*
+ * zip.c -- 压缩长时间没有被访问的量子
+ * 开启压缩的设备每隔zip_idle秒由scull_wq中的工作扫描一遍: 与分层存储
+ * 共用量子集中的引用位, 访问量子时置位, 扫描时清除; 一个周期内没有被访问
+ * 的量子用内核压缩接口压缩, 量子集中改为指向struct scull_zquantum的
+ * 带标记指针(最低位为1), 原来的量子归还到量子池
+ * 读者和写者遇到压缩的量子时与换出的量子一样, 在量子集的信号量保护下
+ * 由scull_tier_load调入: 解压到新的量子后释放压缩的数据. 每次缺页只解压
+ * 一个量子, 且只压缩不超过SCULL_ZIP_MAX的量子, 因此一次读取等待解压的
+ * 时间有上界; 解压的延迟记入统计信息中的inflate直方图
+ * 引用位同时被分层存储的CLOCK指针清除, 两者都开启时量子可能提前被压缩
+ * 与快照共享的量子和被映射的设备不压缩
+ */
+
+#include "shim.h"
+#ifdef __KERNEL__
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/crypto.h>
+#endif
+
+#include "scull.h"
+
+char *scull_zip_alg = "lz4";    // 压缩算法, 内核不支持时改用deflate
+int scull_zip_idle;             // 默认的压缩周期(秒), 0为不压缩
+
+module_param(scull_zip_alg, charp, S_IRUGO);
+module_param(scull_zip_idle, int, S_IRUGO);
+
+#define SCULL_ZIP_MAX	(64 * 1024)     // 可以压缩的最大量子, 限制一次解压的延迟
+
+// 压缩的量子, 由kmalloc申请, 地址至少按8字节对齐, 最低位用作标记
+struct scull_zquantum {
+    unsigned int len;       // 压缩后的字节数
+    char data[0];
+};
+
+#define scull_zq(q)		((struct scull_zquantum *)((unsigned long)(q) & ~1UL))
+
+// 申请压缩器, 优先使用scull_zip_alg
+static struct crypto_comp *scull_zip_alloc_tfm(void)
+{
+    struct crypto_comp *tfm;
+
+    tfm = crypto_alloc_comp(scull_zip_alg, 0, 0);
+    if (!IS_ERR(tfm) || !strcmp(scull_zip_alg, "deflate"))
+        return tfm;
+    printk(KERN_NOTICE "scull: no %s compressor, using deflate\n", scull_zip_alg);
+    return crypto_alloc_comp("deflate", 0, 0);
+}
+
+/**
+ * 把压缩的量子q解压到buf, 调用者持有量子所在量子集的信号量
+ * 返回0或错误码, 解压后的长度不是quantum时数据已损坏
+ */
+int scull_unzip(struct scull_dev *dev, void *q, void *buf, int quantum)
+{
+    struct scull_zquantum *zq = scull_zq(q);
+    unsigned int dlen = quantum;
+    u64 start = scull_now();
+    int ret;
+
+    down(&dev->zip_sem);
+    ret = crypto_comp_decompress(dev->zip_tfm, (u8 *)zq->data, zq->len,
+                                (u8 *)buf, &dlen);
+    up(&dev->zip_sem);
+    if (!ret && dlen != quantum)
+        ret = -EIO;
+    scull_stat_op(dev, SCULL_OP_INFLATE, quantum, ret ? ret : quantum,
+                    scull_now() - start);
+    return ret;
+}
+
+/**
+ * 释放压缩的量子q, q不是压缩的量子时什么也不做
+ * 读者不解引用压缩的量子, 因此可以在量子集的信号量下立即释放
+ */
+void scull_zip_free(struct scull_dev *dev, void *q, int quantum)
+{
+    struct scull_zquantum *zq;
+
+    if (!scull_quantum_zipped(q))
+        return;
+    zq = scull_zq(q);
+    atomic_long_sub(zq->len, &dev->zip_bytes);
+    atomic_long_sub(quantum, &dev->zip_orig);
+    kfree(zq);
+}
+
+/**
+ * 压缩量子q, 压缩后不能节省至少1/8的空间时返回NULL
+ * buf为quantum字节的暂存区, 返回带标记的指针
+ */
+static void *scull_zip_quantum(struct scull_dev *dev, void *q, char *buf,
+                                int quantum)
+{
+    struct scull_zquantum *zq;
+    unsigned int dlen = quantum - quantum / 8;
+    int ret;
+
+    down(&dev->zip_sem);
+    ret = crypto_comp_compress(dev->zip_tfm, (u8 *)q, quantum, (u8 *)buf, &dlen);
+    up(&dev->zip_sem);
+    if (ret || dlen > quantum - quantum / 8)
+        return NULL;
+    zq = kmalloc(sizeof(struct scull_zquantum) + dlen, GFP_KERNEL);
+    if (!zq)
+        return NULL;
+    zq->len = dlen;
+    memcpy(zq->data, buf, dlen);
+    atomic_long_add(dlen, &dev->zip_bytes);
+    atomic_long_add(quantum, &dev->zip_orig);
+    return (void *)((unsigned long)zq | 1);
+}
+
+/**
+ * 扫描整个设备一遍, 压缩引用位没有置位的量子, 清除其余量子的引用位
+ * 每个量子集单独获取dev->sem, 索引在两次之间被替换时停止
+ * 被替换下的量子宽限期过后才归还到量子池. 返回压缩的量子数
+ */
+int scull_zip_sweep(struct scull_dev *dev)
+{
+    struct scull_index *idx, *start = NULL;
+    struct scull_qset *dptr;
+    struct scull_tier_batch *batch = NULL;
+    char *buf = NULL;
+    unsigned long *ref;
+    int item, j, nr = 0;
+    void *q, *zq;
+
+    for (item = 0; ; item++) {
+        down(&dev->sem);
+        idx = dev->data;
+        if (!start)
+            start = idx;
+        if (!idx || idx != start || item >= idx->nitems ||
+                atomic_read(&dev->vmas) || idx->quantum > SCULL_ZIP_MAX) {
+            up(&dev->sem);
+            break;
+        }
+        if (!buf)
+            buf = vmalloc(idx->quantum);
+        dptr = idx->items[item];
+        if (!buf || !dptr) {
+            up(&dev->sem);
+            if (!buf)
+                break;
+            continue;
+        }
+        down(&dptr->sem);
+        ref = scull_qset_ref(dptr, idx->qset);
+        for (j = 0; j < idx->qset; j++) {
+            q = dptr->data[j];
+            if (!scull_quantum_real(q) || test_and_clear_bit(j, ref) ||
+                    scull_qset_quantum_shared(dptr, idx->qset, j))
+                continue;
+            if (!batch) {
+                batch = scull_tier_batch_alloc(dev, idx->quantum);
+                if (!batch)
+                    break;
+            }
+            zq = scull_zip_quantum(dev, q, buf, idx->quantum);
+            if (!zq)
+                continue;
+            // 之前开始的读者仍可以读旧量子, 宽限期后才释放
+            rcu_assign_pointer(dptr->data[j], zq);
+            if (scull_tier_batch_add(batch, q)) {
+                scull_tier_batch_done(batch);
+                batch = NULL;
+            }
+            nr++;
+        }
+        up(&dptr->sem);
+        up(&dev->sem);
+        cond_resched();
+    }
+    if (batch)
+        scull_tier_batch_done(batch);
+    if (buf)
+        vfree(buf);
+    return nr;
+}
+
+// 工作队列函数: 扫描一遍, 之后每隔zip_idle秒再扫描
+static void scull_zip_work(void *data)
+{
+    struct scull_dev *dev = data;
+
+    if (!dev->zip_idle)
+        return;
+    scull_zip_sweep(dev);
+    if (dev->zip_idle)
+        queue_delayed_work(scull_wq, &dev->zip_work, dev->zip_idle * HZ);
+}
+
+void scull_zip_init(struct scull_dev *dev)
+{
+    dev->zip_tfm = NULL;
+    dev->zip_idle = 0;
+    init_MUTEX(&dev->zip_sem);
+    atomic_long_set(&dev->zip_bytes, 0);
+    atomic_long_set(&dev->zip_orig, 0);
+    INIT_WORK(&dev->zip_work, scull_zip_work, dev);
+}
+
+/**
+ * 设置压缩周期(秒), 0为停止压缩; 已经压缩的量子在访问时解压
+ * 第一次开启时申请压缩器, 直到设备清除时才释放
+ */
+int scull_set_zip(struct scull_dev *dev, unsigned int idle)
+{
+    struct crypto_comp *tfm;
+
+    if (idle && !dev->zip_tfm) {
+        tfm = scull_zip_alloc_tfm();
+        if (IS_ERR(tfm))
+            return PTR_ERR(tfm);
+        down(&dev->sem);
+        if (!dev->zip_tfm)
+            dev->zip_tfm = tfm;
+        else
+            crypto_free_comp(tfm);
+        up(&dev->sem);
+    }
+    cancel_delayed_work(&dev->zip_work);
+    dev->zip_idle = idle;
+    if (idle)
+        queue_delayed_work(scull_wq, &dev->zip_work, idle * HZ);
+    return 0;
+}
+
+// 停止压缩, 调用者随后清空scull_wq
+void scull_zip_stop(struct scull_dev *dev)
+{
+    dev->zip_idle = 0;
+    cancel_delayed_work(&dev->zip_work);
+}
+
+// 释放压缩器, 调用者保证设备已被清空
+void scull_zip_release(struct scull_dev *dev)
+{
+    if (dev->zip_tfm)
+        crypto_free_comp(dev->zip_tfm);
+    dev->zip_tfm = NULL;
+}